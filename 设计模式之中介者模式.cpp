@@ -30,22 +30,373 @@
  */
 #include "iostream"
 #include "string"
+#include "atomic"
+#include "memory"
+#include "thread"
+#include "vector"
+#include "chrono"
+#include "cstdint"
+#include "bit"
+#include "random"
+#include "algorithm"
+#include "mutex"
+#include "cstring"
+#include "stdexcept"
+#include "utility"
+#include "span"
+#include "deque"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "x86intrin.h"
+#elif defined(_M_X64) || defined(_M_IX86)
+#include "intrin.h"
+#endif
+
+//共享内存队列直接放在/dev/shm下的文件里，只有Linux保证有这个目录(macOS和BSD没有)
+#ifdef __linux__
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/wait.h"
+#define MEDIATOR_HAS_SHM 1
+#endif
+
+//置为1时InstrumentedMediator默认开启按路由统计，置为0时它和ConcreteMediator完全一样
+#ifndef MEDIATOR_INSTRUMENTATION
+#define MEDIATOR_INSTRUMENTATION 0
+#endif
 
 using namespace std;
 
-//转发协议
-enum class Message {
+//转发协议，三个具名协议之外的取值可以当作主题编号使用(见Topic)
+enum class Message : uint32_t {
     ATW_MESSAGE,    //App-->Win
     ATM_MESSAGE,    //App-->Mac
     WTM_MESSAGE     //Win-->Mac
 };
 
+constexpr size_t kMessageCount = 3;
+
+//把任意编号当作主题，用于TopicMediator
+constexpr Message Topic(uint32_t id) { return static_cast<Message>(id); }
+
+class PayloadArena;
+
+//消息体内存块的头部，数据紧跟在头部之后
+struct PayloadBlock {
+    atomic<uint32_t> refs;
+    uint32_t size;
+    PayloadArena *arena;
+    PayloadBlock *next;
+
+    char *Data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+//消息体的引用计数句柄，拷贝句柄只增加计数，不拷贝数据，最后一个句柄析构时把内存块还给slab
+class PayloadRef {
+public:
+    PayloadRef() = default;
+
+    explicit PayloadRef(PayloadBlock *block) : block(block) {}
+
+    PayloadRef(const PayloadRef &other) : block(other.block) {
+        if (block != nullptr) {
+            block->refs.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    PayloadRef(PayloadRef &&other) noexcept: block(exchange(other.block, nullptr)) {}
+
+    PayloadRef &operator=(PayloadRef other) noexcept {
+        swap(block, other.block);
+        return *this;
+    }
+
+    ~PayloadRef() { Reset(); }
+
+    inline void Reset();
+
+    const char *Data() const { return block->Data(); }
+
+    //只应在广播之前由创建者填写
+    char *MutableData() { return block->Data(); }
+
+    size_t Size() const { return block != nullptr ? block->size : 0; }
+
+    explicit operator bool() const { return block != nullptr; }
+
+private:
+    PayloadBlock *block = nullptr;
+};
+
+//定长分块的slab：消息体只在这里分配一次，广播给多少个接收方都共享同一块内存
+//arena必须比它分配出去的所有句柄活得更久
+class PayloadArena {
+public:
+    struct Stats {
+        uint64_t slabAllocations;   //向系统申请slab的次数
+        uint64_t blocksAcquired;    //分配出去的消息体个数
+        uint64_t bytesCopied;       //写入消息体时拷贝的字节数
+    };
+
+    PayloadArena(size_t blockCapacity = 1024, size_t blocksPerSlab = 256)
+            : blockCapacity(blockCapacity), blocksPerSlab(blocksPerSlab),
+              stride((sizeof(PayloadBlock) + blockCapacity + alignof(PayloadBlock) - 1) /
+                     alignof(PayloadBlock) * alignof(PayloadBlock)) {}
+
+    //只分配不拷贝，调用方通过MutableData直接写入
+    PayloadRef Allocate(size_t size) {
+        if (size > blockCapacity) {
+            throw length_error("消息体超过slab块大小");
+        }
+        PayloadBlock *block;
+        {
+            lock_guard<mutex> guard(lock);
+            if (freeList == nullptr) {
+                Grow();
+            }
+            block = freeList;
+            freeList = block->next;
+        }
+        block->refs.store(1, memory_order_relaxed);
+        block->size = size;
+        blocksAcquired.fetch_add(1, memory_order_relaxed);
+        return PayloadRef(block);
+    }
+
+    PayloadRef Create(const void *data, size_t size) {
+        PayloadRef payload = Allocate(size);
+        memcpy(payload.MutableData(), data, size);
+        bytesCopied.fetch_add(size, memory_order_relaxed);
+        return payload;
+    }
+
+    void Release(PayloadBlock *block) {
+        lock_guard<mutex> guard(lock);
+        block->next = freeList;
+        freeList = block;
+    }
+
+    Stats GetStats() const {
+        return {slabAllocations.load(), blocksAcquired.load(), bytesCopied.load()};
+    }
+
+private:
+    void Grow() {
+        slabs.push_back(make_unique<char[]>(stride * blocksPerSlab));
+        slabAllocations.fetch_add(1, memory_order_relaxed);
+        for (size_t i = 0; i < blocksPerSlab; ++i) {
+            auto *block = new(slabs.back().get() + i * stride) PayloadBlock;
+            block->arena = this;
+            block->next = freeList;
+            freeList = block;
+        }
+    }
+
+    size_t blockCapacity;
+    size_t blocksPerSlab;
+    size_t stride;
+    mutex lock;
+    PayloadBlock *freeList = nullptr;
+    vector<unique_ptr<char[]>> slabs;
+    atomic<uint64_t> slabAllocations{0};
+    atomic<uint64_t> blocksAcquired{0};
+    atomic<uint64_t> bytesCopied{0};
+};
+
+void PayloadRef::Reset() {
+    if (block != nullptr && block->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        block->arena->Release(block);
+    }
+    block = nullptr;
+}
+
+//带消息体的消息，消息体可以为空
+struct Envelope {
+    Message message;
+    PayloadRef payload;
+};
+
+//模块编号，注册到中介者时分配，没注册的模块统一用UNREGISTERED_ID
+enum ModuleId : uint8_t {
+    APP_ID,
+    WIN_ID,
+    MAC_ID,
+    UNREGISTERED_ID,
+    MODULE_ID_COUNT
+};
+
+//(协议, 发送方编号) -> 接收方编号
+//对注册过的模块，规则和原来的dynamic_cast判断一致：发送方是协议的起点就转给终点，否则转回起点
+//没注册的发送方一律查UNREGISTERED_ID那一列，即转回起点；这和原来不同：原来按动态类型判断，没注册的App实例发ATM也会转给Mac，现在会转回app
+constexpr uint8_t kRouteTable[kMessageCount][MODULE_ID_COUNT] = {
+        /*ATW*/ {WIN_ID, APP_ID, APP_ID, APP_ID},
+        /*ATM*/ {MAC_ID, APP_ID, APP_ID, APP_ID},
+        /*WTM*/ {WIN_ID, MAC_ID, WIN_ID, WIN_ID},
+};
+
+//查路由表；Topic()可以造出任意编号的Message，超出协议范围的消息返回UNREGISTERED_ID(没有接收方)，
+//超出范围的发送方编号按没注册处理
+constexpr uint32_t RouteOf(Message message, uint32_t sender) {
+    if ((size_t) message >= kMessageCount) {
+        return UNREGISTERED_ID;
+    }
+    return kRouteTable[(size_t) message][sender < UNREGISTERED_ID ? sender : (uint32_t) UNREGISTERED_ID];
+}
+
 class AbstractModule;
 
+//有界无锁多生产者单消费者队列(MPSC)，每个格子带一个序号，生产者用CAS抢占tail，消费者独占head
+//同一时刻只能有一个消费者调用TryPop；消费权可以在线程之间转移，所以head也是原子变量，只用relaxed读写
+template<typename T, size_t Capacity>
+class MpscMailbox {
+    static_assert((Capacity & (Capacity - 1)) == 0, "容量必须是2的幂");
+
+public:
+    MpscMailbox() {
+        for (size_t i = 0; i < Capacity; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    //成功时把value移进队列，队列满时返回false且不动value，由调用方决定重试还是丢弃
+    bool TryPush(T &value) {
+        size_t pos = tail.load(memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells[pos & (Capacity - 1)];
+            size_t seq = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool TryPop(T &value) {
+        size_t pos = head.load(memory_order_relaxed);
+        Cell &cell = cells[pos & (Capacity - 1)];
+        if (cell.sequence.load(memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(pos + Capacity, memory_order_release);
+        head.store(pos + 1, memory_order_relaxed);
+        return true;
+    }
+
+    //派发池里刚放弃消费权的线程也会调用，这时别的线程可能正在TryPop，结果可能已经过时，由拿到消费权的线程负责处理剩下的消息
+    bool Empty() const {
+        size_t pos = head.load(memory_order_relaxed);
+        return cells[pos & (Capacity - 1)].sequence.load(memory_order_acquire) != pos + 1;
+    }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    alignas(64) atomic<size_t> tail{0};
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) Cell cells[Capacity];
+};
+
+//模块的信箱：在MPSC队列之上加了休眠/唤醒，派发线程没消息时挂起，发送方只在对方休眠时才去唤醒
+class ModuleMailbox {
+public:
+    //信箱满了就让出CPU等派发线程腾位置(背压)；running为false时没有派发线程会腾位置，直接返回false
+    bool Post(Envelope envelope, const atomic<bool> &running) {
+        while (!TryPost(envelope)) {
+            if (!running.load(memory_order_relaxed)) {
+                return false;
+            }
+            this_thread::yield();
+        }
+        return true;
+    }
+
+    //信箱满时返回false，envelope保持不变
+    bool TryPost(Envelope &envelope) {
+        if (!queue.TryPush(envelope)) {
+            return false;
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        if (waiting.load(memory_order_relaxed)) {
+            Wake();
+        }
+        return true;
+    }
+
+    bool TryPop(Envelope &envelope) { return queue.TryPop(envelope); }
+
+    //只由派发线程调用，先声明要休眠再检查一次队列，避免错过唤醒
+    //读到seen之后还要再看一次running：停止方先清running再Wake，若这里看到running仍为true，Wake的自增一定在seen之后，wait不会睡死
+    void Wait(const atomic<bool> &running) {
+        waiting.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint32_t seen = signal.load(memory_order_seq_cst);
+        if (queue.Empty() && running.load(memory_order_seq_cst)) {
+            signal.wait(seen, memory_order_acquire);
+        }
+        waiting.store(false, memory_order_relaxed);
+    }
+
+    void Wake() {
+        signal.fetch_add(1, memory_order_release);
+        signal.notify_one();
+    }
+
+    bool Empty() const { return queue.Empty(); }
+
+    //派发池用的调度标记：投递方在TryPost之后抢这个标记，抢到的负责把模块放进任务队列
+    //处理方清除标记后要再检查一次信箱，所以同一时刻只有一个线程在消费信箱
+    bool TrySchedule() { return !scheduled.exchange(true, memory_order_seq_cst); }
+
+    void Unschedule() {
+        scheduled.store(false, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+
+private:
+    MpscMailbox<Envelope, 1024> queue;
+    atomic<bool> waiting{false};
+    atomic<uint32_t> signal{0};
+    atomic<bool> scheduled{false};
+};
+
+class WorkStealingPool;
+
 //提供转发接口父类
 class AbstractMediator {
 public:
     virtual void Transmit(Message message, AbstractModule *pm) = 0;
+
+    //带消息体的转发，默认丢弃消息体，支持消息体的中介者需要重写
+    virtual void Transmit(const Envelope &envelope, AbstractModule *pm) {
+        Transmit(envelope.message, pm);
+    }
+
+    //批量转发，默认逐条转发，中介者可以重写为按接收方合并
+    inline virtual void TransmitBatch(span<const Message> messages, AbstractModule *pm);
+
+    //设置派发池后，中介者把消息交给派发池异步投递；为空时在发送方线程里直接调用AcceptMessage
+    void SetDispatchPool(WorkStealingPool *pool) { this->pool = pool; }
+
+protected:
+    inline void Deliver(AbstractModule *receiver, Message message);
+
+    inline void Deliver(AbstractModule *receiver, const Envelope &envelope);
+
+    WorkStealingPool *pool = nullptr;
 };
 
 //模块的父类
@@ -53,16 +404,221 @@ class AbstractModule {
 public:
     AbstractModule(AbstractMediator *pm) : pm(pm) {}
 
+    virtual ~AbstractModule() {
+        delete mailbox.load();
+    }
+
     void SendMessage(Message message) {
         pm->Transmit(message, this);
     }
 
+    //发送带消息体的消息，消息体按引用计数共享
+    void SendMessage(Message message, PayloadRef payload) {
+        pm->Transmit(Envelope{message, std::move(payload)}, this);
+    }
+
     virtual void AcceptMessage(Message message) = 0;
 
+    //接收带消息体的消息，默认忽略消息体；需要保留消息体时拷贝句柄即可
+    virtual void AcceptMessage(const Envelope &envelope) {
+        AcceptMessage(envelope.message);
+    }
+
+    //一次发送一串消息
+    void SendMessages(span<const Message> messages) {
+        pm->TransmitBatch(messages, this);
+    }
+
+    //一次接收发给自己的一串消息，默认逐条调用AcceptMessage
+    virtual void AcceptMessages(span<const Message> messages) {
+        for (Message message: messages) {
+            AcceptMessage(message);
+        }
+    }
+
+    //异步模式才需要信箱，第一次使用时创建，多个线程同时调用也只会创建一个
+    ModuleMailbox *EnableMailbox() {
+        ModuleMailbox *current = mailbox.load(memory_order_acquire);
+        if (current == nullptr) {
+            auto created = make_unique<ModuleMailbox>();
+            if (mailbox.compare_exchange_strong(current, created.get(), memory_order_acq_rel)) {
+                current = created.release();
+            }
+        }
+        return current;
+    }
+
+    ModuleMailbox *GetMailbox() const { return mailbox.load(memory_order_acquire); }
+
+    uint32_t GetModuleId() const { return moduleId; }
+
+    void SetModuleId(uint32_t id) { moduleId = id; }
+
 protected:
     AbstractMediator *pm;
+    atomic<ModuleMailbox *> mailbox{nullptr};
+    uint32_t moduleId = UNREGISTERED_ID;
+};
+
+void AbstractMediator::TransmitBatch(span<const Message> messages, AbstractModule *pm) {
+    for (Message message: messages) {
+        Transmit(message, pm);
+    }
+}
+
+//工作窃取派发池：每个工作线程有自己的任务队列，自己的队列空了就从别的线程队列尾部偷任务
+//任务的单位是模块：模块的信箱从空变为非空时被调度一次，处理完一批消息后再重新排队
+//同一时刻最多只有一个线程在处理某个模块，所以每个模块收到消息的顺序和投递顺序一致，而不同模块可以分散到各个核上
+class WorkStealingPool {
+public:
+    //hardware_concurrency可能返回0，至少开一个工作线程
+    WorkStealingPool(size_t workerCount = thread::hardware_concurrency()) : workers(max<size_t>(1, workerCount)) {
+        for (size_t i = 0; i < workers.size(); ++i) {
+            threads.emplace_back(&WorkStealingPool::Work, this, i);
+        }
+    }
+
+    //析构前会处理完所有已投递的消息
+    ~WorkStealingPool() {
+        stopping.store(true);
+        epoch.fetch_add(1);
+        epoch.notify_all();
+        for (auto &t: threads) {
+            t.join();
+        }
+    }
+
+    //信箱满时调用方帮忙处理其他模块的任务，避免工作线程互相投递时卡死
+    void Post(AbstractModule *receiver, Envelope envelope) {
+        ModuleMailbox *mailbox = receiver->EnableMailbox();
+        while (!mailbox->TryPost(envelope)) {
+            if (!RunOne()) {
+                this_thread::yield();
+            }
+        }
+        if (mailbox->TrySchedule()) {
+            Schedule(receiver);
+        }
+    }
+
+private:
+    struct alignas(64) Worker {
+        mutex lock;
+        deque<AbstractModule *> tasks;
+    };
+
+    static constexpr size_t kBatch = 64;
+
+    //工作线程放进自己的队列，外部线程轮流放进各个队列
+    void Schedule(AbstractModule *module) {
+        size_t index = current == this ? currentIndex : next.fetch_add(1, memory_order_relaxed) % workers.size();
+        {
+            lock_guard<mutex> guard(workers[index].lock);
+            workers[index].tasks.push_back(module);
+        }
+        epoch.fetch_add(1);
+        if (sleepers.load() > 0) {
+            epoch.notify_one();
+        }
+    }
+
+    //先从自己队列头部取，再从其他队列尾部偷
+    AbstractModule *Take() {
+        size_t self = current == this ? currentIndex : 0;
+        for (size_t i = 0; i < workers.size(); ++i) {
+            Worker &worker = workers[(self + i) % workers.size()];
+            lock_guard<mutex> guard(worker.lock);
+            if (!worker.tasks.empty()) {
+                AbstractModule *module;
+                if (i == 0 && current == this) {
+                    module = worker.tasks.front();
+                    worker.tasks.pop_front();
+                } else {
+                    module = worker.tasks.back();
+                    worker.tasks.pop_back();
+                }
+                return module;
+            }
+        }
+        return nullptr;
+    }
+
+    bool RunOne() {
+        AbstractModule *module = Take();
+        if (module == nullptr) {
+            return false;
+        }
+        Run(module);
+        return true;
+    }
+
+    //处理一批消息；信箱还有剩余就继续排队，否则清除调度标记后再检查一次
+    void Run(AbstractModule *module) {
+        ModuleMailbox *mailbox = module->GetMailbox();
+        Envelope envelope;
+        for (size_t n = 0; n < kBatch && mailbox->TryPop(envelope); ++n) {
+            module->AcceptMessage(envelope);
+        }
+        envelope.payload.Reset();
+        if (!mailbox->Empty()) {
+            Schedule(module);
+            return;
+        }
+        mailbox->Unschedule();
+        if (!mailbox->Empty() && mailbox->TrySchedule()) {
+            Schedule(module);
+        }
+    }
+
+    void Work(size_t index) {
+        current = this;
+        currentIndex = index;
+        for (;;) {
+            if (RunOne()) {
+                continue;
+            }
+            sleepers.fetch_add(1);
+            uint32_t seen = epoch.load();
+            if (RunOne()) {
+                sleepers.fetch_sub(1);
+                continue;
+            }
+            if (stopping.load()) {
+                sleepers.fetch_sub(1);
+                break;
+            }
+            epoch.wait(seen);
+            sleepers.fetch_sub(1);
+        }
+    }
+
+    inline static thread_local WorkStealingPool *current = nullptr;
+    inline static thread_local size_t currentIndex = 0;
+
+    vector<Worker> workers;
+    vector<thread> threads;
+    atomic<size_t> next{0};
+    atomic<uint32_t> epoch{0};
+    atomic<int> sleepers{0};
+    atomic<bool> stopping{false};
 };
 
+void AbstractMediator::Deliver(AbstractModule *receiver, Message message) {
+    if (pool != nullptr) {
+        pool->Post(receiver, {message, {}});
+    } else {
+        receiver->AcceptMessage(message);
+    }
+}
+
+void AbstractMediator::Deliver(AbstractModule *receiver, const Envelope &envelope) {
+    if (pool != nullptr) {
+        pool->Post(receiver, envelope);
+    } else {
+        receiver->AcceptMessage(envelope);
+    }
+}
+
 class App : public AbstractModule {
 public:
     App(AbstractMediator *pM) : AbstractModule(pM) {}
@@ -117,21 +673,118 @@ public:
     //为中介者设定模块
     void SetModuleApp(AbstractModule *app) {
         this->app = app;
+        Register(APP_ID, app);
     }
 
     void SetModuleWin(AbstractModule *win) {
         this->win = win;
+        Register(WIN_ID, win);
     }
 
     void SetModuleMac(AbstractModule *mac) {
         this->mac = mac;
+        Register(MAC_ID, mac);
     }
 
     //转发
+    void Transmit(Message message, AbstractModule *pM) {
+        AbstractModule *receiver = Route(message, pM);
+        if (receiver != nullptr) {
+            Deliver(receiver, message);
+        }
+    }
+
+    void Transmit(const Envelope &envelope, AbstractModule *pM) {
+        AbstractModule *receiver = Route(envelope.message, pM);
+        if (receiver != nullptr) {
+            Deliver(receiver, envelope);
+        }
+    }
+
+    //按接收方分组(计数排序，组内保持原顺序)，每个接收方只调用一次AcceptMessages
+    //使用派发池时逐条交给派发池
+    void TransmitBatch(span<const Message> messages, AbstractModule *pM) {
+        if (messages.empty()) {
+            return;
+        }
+        if (pool != nullptr) {
+            AbstractMediator::TransmitBatch(messages, pM);
+            return;
+        }
+        uint32_t sender = pM->GetModuleId();
+        size_t begin[MODULE_ID_COUNT + 1] = {};
+        for (Message message: messages) {
+            ++begin[RouteOf(message, sender) + 1];
+        }
+        //全部发往同一个接收方时直接转交原数组
+        for (size_t id = 0; id < MODULE_ID_COUNT; ++id) {
+            if (begin[id + 1] == messages.size()) {
+                if (modules[id] != nullptr) {
+                    modules[id]->AcceptMessages(messages);
+                }
+                return;
+            }
+        }
+        for (size_t id = 0; id < MODULE_ID_COUNT; ++id) {
+            begin[id + 1] += begin[id];
+        }
+
+        //小批量用栈上的缓冲区，接收方在AcceptMessages里再次批量发送也不会互相覆盖
+        Message stackBuffer[256];
+        vector<Message> heapBuffer;
+        Message *grouped = stackBuffer;
+        if (messages.size() > size(stackBuffer)) {
+            heapBuffer.resize(messages.size());
+            grouped = heapBuffer.data();
+        }
+        size_t next[MODULE_ID_COUNT];
+        copy_n(begin, MODULE_ID_COUNT, next);
+        for (Message message: messages) {
+            grouped[next[RouteOf(message, sender)]++] = message;
+        }
+        for (size_t id = 0; id < MODULE_ID_COUNT; ++id) {
+            if (begin[id + 1] > begin[id] && modules[id] != nullptr) {
+                modules[id]->AcceptMessages({grouped + begin[id], begin[id + 1] - begin[id]});
+            }
+        }
+    }
+
+protected:
+    //根据协议和发送方找出接收方，只需查一次表；越界的协议没有接收方，越界的发送方编号按没注册处理
+    AbstractModule *Route(Message message, AbstractModule *pM) const {
+        if ((size_t) message >= kMessageCount) {
+            return nullptr;
+        }
+        uint32_t sender = pM->GetModuleId();
+        return routes[(size_t) message][sender < UNREGISTERED_ID ? sender : (uint32_t) UNREGISTERED_ID];
+    }
+
+    //分配模块编号，并把路由表里的编号换成模块指针
+    void Register(uint32_t id, AbstractModule *module) {
+        module->SetModuleId(id);
+        modules[id] = module;
+        for (size_t m = 0; m < kMessageCount; ++m) {
+            for (size_t sender = 0; sender < MODULE_ID_COUNT; ++sender) {
+                routes[m][sender] = modules[kRouteTable[m][sender]];
+            }
+        }
+    }
+
+    AbstractModule *app = nullptr;
+    AbstractModule *win = nullptr;
+    AbstractModule *mac = nullptr;
+    AbstractModule *modules[MODULE_ID_COUNT] = {};
+    AbstractModule *routes[kMessageCount][MODULE_ID_COUNT] = {};
+};
+
+//原来的实现：每条消息都用dynamic_cast判断发送方类型，保留下来作为路由表的对照
+class DynamicCastMediator : public ConcreteMediator {
+public:
+    using ConcreteMediator::Transmit;
+
     void Transmit(Message message, AbstractModule *pM) {
         switch (message) {
             case Message::ATM_MESSAGE: {
-                //通过dynamic_cast转换确认指针指向的子类类型
                 App *app = dynamic_cast<App *>(pM);
                 if (app != nullptr) {
                     mac->AcceptMessage(message);
@@ -149,7 +802,6 @@ public:
                 }
                 break;
             }
-
             case Message::WTM_MESSAGE: {
                 Windows *win = dynamic_cast<Windows *>(pM);
                 if (win != nullptr) {
@@ -161,33 +813,1112 @@ public:
             }
         }
     }
+};
 
-protected:
-    AbstractModule *app = nullptr;
-    AbstractModule *win = nullptr;
-    AbstractModule *mac = nullptr;
+//读取时间戳，x86上用rdtsc(几个纳秒)，其他平台退回steady_clock
+inline uint64_t ReadTicks() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+//每纳秒对应的时间戳计数，第一次调用时校准一次
+inline double TicksPerNs() {
+    static double ticksPerNs = [] {
+        auto begin = chrono::steady_clock::now();
+        uint64_t ticks = ReadTicks();
+        this_thread::sleep_for(chrono::milliseconds(20));
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+        return (ReadTicks() - ticks) / ns;
+    }();
+    return ticksPerNs;
+}
+
+//HDR风格的延迟直方图下标：按2的幂分段，每段再线性分成4个子桶，相对误差不超过25%
+struct LatencyBuckets {
+    static constexpr size_t kSubBits = 2;
+    static constexpr size_t kCount = 64 << kSubBits;
+
+    static size_t IndexOf(uint64_t ticks) {
+        if (ticks < (1 << kSubBits)) {
+            return ticks;
+        }
+        size_t msb = 63 - countl_zero(ticks);
+        return ((msb - kSubBits + 1) << kSubBits) | ((ticks >> (msb - kSubBits)) & ((1 << kSubBits) - 1));
+    }
+
+    static uint64_t LowerBoundOf(size_t index) {
+        if (index < (1 << kSubBits)) {
+            return index;
+        }
+        size_t msb = (index >> kSubBits) + kSubBits - 1;
+        return (uint64_t(1) << msb) | (uint64_t(index & ((1 << kSubBits) - 1)) << (msb - kSubBits));
+    }
 };
 
-void test01() {
-    AbstractMediator *pM = new ConcreteMediator;
-    //指定中介者
-    AbstractModule *app = new App(pM);
-    AbstractModule *win = new Windows(pM);
-    AbstractModule *mac = new Mac(pM);
+//按(协议, 发送方, 接收方)统计转发次数和延迟
+//每个线程写自己的统计块，只有本线程写入，所以只用relaxed的load/store，热路径上没有锁和原子读改写
+//次数每条都记，延迟按1/kSampleEvery的概率随机采样(用xorshift，避免和固定的消息节奏混叠)
+//读两次时间戳的开销就摊薄到每条几个纳秒
+//线程退出后统计块仍然保留在登记表里，Dump时把所有线程的数据合并
+class RouteStats {
+public:
+    static constexpr size_t kRouteCount = kMessageCount * MODULE_ID_COUNT * MODULE_ID_COUNT;
+    static constexpr uint64_t kSampleEvery = 16;
 
+    //本条需要采样时返回起始时间戳，否则返回0
+    static uint64_t BeginSample() {
+        Block *local = Local();
+        uint64_t x = local->random;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        local->random = x;
+        return x % kSampleEvery == 0 ? ReadTicks() : 0;
+    }
 
-    //为中介者设定模块
-    ConcreteMediator *pc = dynamic_cast<ConcreteMediator *>(pM);
-    pc->SetModuleApp(app);
-    pc->SetModuleWin(win);
-    pc->SetModuleMac(mac);
+    //越界的协议不统计，越界的模块编号记在"未注册"下
+    static void Record(Message message, uint32_t sender, uint32_t receiver, uint64_t begin) {
+        if ((size_t) message >= kMessageCount) {
+            return;
+        }
+        sender = min<uint32_t>(sender, UNREGISTERED_ID);
+        receiver = min<uint32_t>(receiver, UNREGISTERED_ID);
+        Block *local = Local();
+        size_t route = ((size_t) message * MODULE_ID_COUNT + sender) * MODULE_ID_COUNT + receiver;
+        Bump(local->counts[route], 1);
+        if (begin != 0) {
+            uint64_t ticks = ReadTicks() - begin;
+            Bump(local->samples[route], 1);
+            Bump(local->ticks[route], ticks);
+            Bump(local->buckets[route][LatencyBuckets::IndexOf(ticks)], 1);
+        }
+    }
 
-    //不同模块之间进行通信
-    app->SendMessage(Message::ATM_MESSAGE);
-    app->SendMessage(Message::ATW_MESSAGE);
-    win->SendMessage(Message::WTM_MESSAGE);
-}
+    //输出每条有流量的路由的次数、平均延迟和分位数
+    static void Dump(ostream &out) {
+        static const char *messages[kMessageCount] = {"ATW", "ATM", "WTM"};
+        static const char *modules[MODULE_ID_COUNT] = {"App", "Win", "Mac", "未注册"};
+        RouteStats &stats = Instance();
+        lock_guard<mutex> guard(stats.lock);
+        for (size_t route = 0; route < kRouteCount; ++route) {
+            uint64_t count = 0, samples = 0, ticks = 0;
+            vector<uint64_t> merged(LatencyBuckets::kCount);
+            for (auto &block: stats.blocks) {
+                count += block->counts[route].load(memory_order_relaxed);
+                samples += block->samples[route].load(memory_order_relaxed);
+                ticks += block->ticks[route].load(memory_order_relaxed);
+                for (size_t b = 0; b < LatencyBuckets::kCount; ++b) {
+                    merged[b] += block->buckets[route][b].load(memory_order_relaxed);
+                }
+            }
+            if (count == 0) {
+                continue;
+            }
+            size_t message = route / (MODULE_ID_COUNT * MODULE_ID_COUNT);
+            size_t sender = route / MODULE_ID_COUNT % MODULE_ID_COUNT;
+            size_t receiver = route % MODULE_ID_COUNT;
+            out << messages[message] << " " << modules[sender] << "->" << modules[receiver]
+                << " 次数:" << count;
+            if (samples > 0) {
+                out << " 平均:" << ticks / TicksPerNs() / samples << "ns"
+                    << " p50:" << Percentile(merged, samples, 0.50) << "ns"
+                    << " p99:" << Percentile(merged, samples, 0.99) << "ns";
+            }
+            out << endl;
+        }
+    }
 
-int main() {
-    test01();
+    //清零所有线程的统计，只应在没有转发进行时调用
+    static void Reset() {
+        RouteStats &stats = Instance();
+        lock_guard<mutex> guard(stats.lock);
+        for (auto &block: stats.blocks) {
+            for (size_t route = 0; route < kRouteCount; ++route) {
+                block->counts[route].store(0, memory_order_relaxed);
+                block->samples[route].store(0, memory_order_relaxed);
+                block->ticks[route].store(0, memory_order_relaxed);
+                for (auto &bucket: block->buckets[route]) {
+                    bucket.store(0, memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+private:
+    struct Block {
+        uint64_t random = 0x9e3779b97f4a7c15;
+        atomic<uint64_t> counts[kRouteCount] = {};
+        atomic<uint64_t> samples[kRouteCount] = {};
+        atomic<uint64_t> ticks[kRouteCount] = {};
+        atomic<uint64_t> buckets[kRouteCount][LatencyBuckets::kCount] = {};
+    };
+
+    static RouteStats &Instance() {
+        static RouteStats stats;
+        return stats;
+    }
+
+    static Block *Local() {
+        thread_local Block *local = Instance().NewBlock();
+        return local;
+    }
+
+    static void Bump(atomic<uint64_t> &counter, uint64_t delta) {
+        counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    static double Percentile(const vector<uint64_t> &buckets, uint64_t count, double quantile) {
+        uint64_t rank = (uint64_t) (count * quantile), seen = 0;
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            seen += buckets[b];
+            if (seen > rank) {
+                return LatencyBuckets::LowerBoundOf(b) / TicksPerNs();
+            }
+        }
+        return 0;
+    }
+
+    Block *NewBlock() {
+        lock_guard<mutex> guard(lock);
+        blocks.push_back(make_unique<Block>());
+        return blocks.back().get();
+    }
+
+    mutex lock;
+    vector<unique_ptr<Block>> blocks;
+};
+
+//可以开关统计的中介者，Enabled为false时编译出来就是ConcreteMediator的转发
+template<bool Enabled = MEDIATOR_INSTRUMENTATION>
+class InstrumentedMediator : public ConcreteMediator {
+public:
+    void Transmit(Message message, AbstractModule *pM) {
+        if constexpr (Enabled) {
+            uint64_t begin = RouteStats::BeginSample();
+            AbstractModule *receiver = Route(message, pM);
+            if (receiver != nullptr) {
+                Deliver(receiver, message);
+            }
+            Record(message, pM, receiver, begin);
+        } else {
+            ConcreteMediator::Transmit(message, pM);
+        }
+    }
+
+    void Transmit(const Envelope &envelope, AbstractModule *pM) {
+        if constexpr (Enabled) {
+            uint64_t begin = RouteStats::BeginSample();
+            AbstractModule *receiver = Route(envelope.message, pM);
+            if (receiver != nullptr) {
+                Deliver(receiver, envelope);
+            }
+            Record(envelope.message, pM, receiver, begin);
+        } else {
+            ConcreteMediator::Transmit(envelope, pM);
+        }
+    }
+
+    //批量转发逐条计次数，但不采样延迟：一批的耗时分不到单条消息上
+    void TransmitBatch(span<const Message> messages, AbstractModule *pM) {
+        ConcreteMediator::TransmitBatch(messages, pM);
+        if constexpr (Enabled) {
+            for (Message message: messages) {
+                Record(message, pM, Route(message, pM), 0);
+            }
+        }
+    }
+
+private:
+    static void Record(Message message, AbstractModule *pM, AbstractModule *receiver, uint64_t begin) {
+        RouteStats::Record(message, pM->GetModuleId(),
+                           receiver != nullptr ? receiver->GetModuleId() : (uint32_t) UNREGISTERED_ID, begin);
+    }
+};
+
+//主题中介者：模块数量和主题数量都不固定，模块按主题订阅消息
+//每个主题的订阅者集合是一段按模块编号排列的位图，转发时逐位取出订阅者，不需要按协议写switch
+//注册和订阅需要在转发之前完成，本类不做同步
+class TopicMediator : public AbstractMediator {
+public:
+    TopicMediator(size_t topicCount) : topicCount(topicCount) {}
+
+    //分配模块编号，模块数超过位图宽度时按新宽度重排所有主题的位图
+    void Register(AbstractModule *module) {
+        module->SetModuleId(modules.size());
+        modules.push_back(module);
+        size_t words = (modules.size() + 63) / 64;
+        if (words > wordsPerTopic) {
+            vector<uint64_t> grown(topicCount * words);
+            for (size_t t = 0; t < topicCount; ++t) {
+                copy_n(subscribers.begin() + t * wordsPerTopic, wordsPerTopic, grown.begin() + t * words);
+            }
+            subscribers.swap(grown);
+            wordsPerTopic = words;
+        }
+    }
+
+    //主题越界或模块没有注册到本中介者时抛出out_of_range
+    void Subscribe(AbstractModule *module, Message topic) {
+        uint32_t id = CheckedId(module, topic);
+        subscribers[(size_t) topic * wordsPerTopic + id / 64] |= uint64_t(1) << (id % 64);
+    }
+
+    void Unsubscribe(AbstractModule *module, Message topic) {
+        uint32_t id = CheckedId(module, topic);
+        subscribers[(size_t) topic * wordsPerTopic + id / 64] &= ~(uint64_t(1) << (id % 64));
+    }
+
+    //主题越界时返回0
+    size_t SubscriberCount(Message topic) const {
+        if ((size_t) topic >= topicCount) {
+            return 0;
+        }
+        size_t count = 0;
+        const uint64_t *bits = &subscribers[(size_t) topic * wordsPerTopic];
+        for (size_t w = 0; w < wordsPerTopic; ++w) {
+            count += popcount(bits[w]);
+        }
+        return count;
+    }
+
+    //转发给该主题的所有订阅者，发送方自己不会收到
+    void Transmit(Message message, AbstractModule *pM) {
+        ForEachSubscriber(message, pM, [&](AbstractModule *receiver) {
+            Deliver(receiver, message);
+        });
+    }
+
+    //所有订阅者共享同一个消息体
+    void Transmit(const Envelope &envelope, AbstractModule *pM) {
+        ForEachSubscriber(envelope.message, pM, [&](AbstractModule *receiver) {
+            Deliver(receiver, envelope);
+        });
+    }
+
+    size_t GetBitmapBytes() const { return subscribers.size() * sizeof(uint64_t); }
+
+private:
+    bool IsRegistered(const AbstractModule *module) const {
+        uint32_t id = module->GetModuleId();
+        return id < modules.size() && modules[id] == module;
+    }
+
+    uint32_t CheckedId(AbstractModule *module, Message topic) const {
+        if ((size_t) topic >= topicCount) {
+            throw out_of_range("主题编号越界: " + to_string((size_t) topic));
+        }
+        if (!IsRegistered(module)) {
+            throw out_of_range("模块没有注册到这个中介者");
+        }
+        return module->GetModuleId();
+    }
+
+    //没注册的发送方不在位图里，不需要排除自己
+    template<typename Deliver>
+    void ForEachSubscriber(Message message, AbstractModule *pM, Deliver deliver) {
+        if ((size_t) message >= topicCount) {
+            return;
+        }
+        const uint64_t *bits = &subscribers[(size_t) message * wordsPerTopic];
+        uint32_t self = IsRegistered(pM) ? pM->GetModuleId() : UINT32_MAX;
+        for (size_t w = 0; w < wordsPerTopic; ++w) {
+            uint64_t word = bits[w];
+            if (self / 64 == w) {
+                word &= ~(uint64_t(1) << (self % 64));
+            }
+            while (word != 0) {
+                deliver(modules[w * 64 + countr_zero(word)]);
+                word &= word - 1;
+            }
+        }
+    }
+
+    size_t topicCount;
+    size_t wordsPerTopic = 0;
+    vector<AbstractModule *> modules;
+    vector<uint64_t> subscribers;
+};
+
+//异步中介者：发送方只把消息投进接收方的信箱就返回，每个模块由自己的派发线程取出消息再调用AcceptMessage
+//慢模块(比如Mac)只会堆积自己的信箱，不会阻塞App等发送方
+class AsyncMediator : public ConcreteMediator {
+public:
+    ~AsyncMediator() {
+        Stop();
+    }
+
+    //设定好模块之后再启动派发线程，Start之前发出的消息先留在接收方的信箱里，信箱满了就丢弃并计入Dropped
+    void Start() {
+        running.store(true, memory_order_relaxed);
+        for (AbstractModule *module: {app, win, mac}) {
+            if (module != nullptr) {
+                module->EnableMailbox();
+                dispatchers.emplace_back(&AsyncMediator::Dispatch, this, module);
+            }
+        }
+    }
+
+    //停止前会把信箱里剩余的消息全部派发完，重复调用没有副作用
+    void Stop() {
+        if (dispatchers.empty()) {
+            return;
+        }
+        running.store(false, memory_order_seq_cst);
+        for (AbstractModule *module: {app, win, mac}) {
+            if (module != nullptr && module->GetMailbox() != nullptr) {
+                module->GetMailbox()->Wake();
+            }
+        }
+        for (auto &t: dispatchers) {
+            t.join();
+        }
+        dispatchers.clear();
+    }
+
+    void Transmit(Message message, AbstractModule *pM) {
+        AbstractModule *receiver = Route(message, pM);
+        if (receiver != nullptr && !receiver->EnableMailbox()->Post({message, {}}, running)) {
+            dropped.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    void Transmit(const Envelope &envelope, AbstractModule *pM) {
+        AbstractModule *receiver = Route(envelope.message, pM);
+        if (receiver != nullptr && !receiver->EnableMailbox()->Post(envelope, running)) {
+            dropped.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    //没有派发线程时信箱满了而丢弃的消息数
+    uint64_t Dropped() const { return dropped.load(memory_order_relaxed); }
+
+    //异步模式下逐条投递到信箱
+    void TransmitBatch(span<const Message> messages, AbstractModule *pM) {
+        AbstractMediator::TransmitBatch(messages, pM);
+    }
+
+private:
+    void Dispatch(AbstractModule *module) {
+        ModuleMailbox *mailbox = module->GetMailbox();
+        Envelope envelope;
+        for (;;) {
+            while (mailbox->TryPop(envelope)) {
+                module->AcceptMessage(envelope);
+            }
+            if (!running.load(memory_order_relaxed)) {
+                while (mailbox->TryPop(envelope)) {
+                    module->AcceptMessage(envelope);
+                }
+                break;
+            }
+            mailbox->Wait(running);
+        }
+    }
+
+    atomic<bool> running{false};
+    atomic<uint64_t> dropped{0};
+    vector<thread> dispatchers;
+};
+
+#ifdef MEDIATOR_HAS_SHM
+
+//放在共享内存文件里的有界MPSC环形队列，结构和MpscMailbox相同，多个进程可以同时写入，只有一个进程读取
+class ShmRing {
+    static_assert(atomic<uint64_t>::is_always_lock_free, "共享内存里的原子变量必须是无锁的");
+
+    struct Cell {
+        atomic<uint64_t> sequence;
+        uint32_t message;
+        uint32_t sender;
+    };
+
+    struct Header {
+        atomic<uint64_t> ready;
+        uint64_t capacity;
+        alignas(64) atomic<uint64_t> tail;
+        alignas(64) atomic<uint64_t> head;
+
+        //格子数组紧跟在头部之后
+        Cell *Cells() { return reinterpret_cast<Cell *>(this + 1); }
+    };
+
+    static constexpr uint64_t kReady = 0x4d45444941544f52;
+
+public:
+    //创建并初始化共享内存文件，capacity必须是2的幂
+    //先删掉上次残留的同名文件再独占创建，不会截断别的进程还映射着的队列
+    ShmRing(const string &path, uint64_t capacity) : path(path), owner(true) {
+        if (!has_single_bit(capacity)) {
+            throw invalid_argument("共享内存队列容量必须是2的幂");
+        }
+        unlink(path.c_str());
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        bytes = sizeof(Header) + capacity * sizeof(Cell);
+        if (fd < 0 || ftruncate(fd, bytes) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw runtime_error("无法创建共享内存文件: " + path);
+        }
+        Map();
+        header->capacity = capacity;
+        header->tail.store(0, memory_order_relaxed);
+        header->head.store(0, memory_order_relaxed);
+        for (uint64_t i = 0; i < capacity; ++i) {
+            header->Cells()[i].sequence.store(i, memory_order_relaxed);
+        }
+        header->ready.store(kReady, memory_order_release);
+    }
+
+    //打开其他进程创建的队列，文件还没准备好时一直等待；容量不是2的幂或超出文件大小时抛出异常
+    explicit ShmRing(const string &path) : path(path), owner(false) {
+        struct stat st{};
+        while ((fd = open(path.c_str(), O_RDWR)) < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Header)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            this_thread::yield();
+        }
+        bytes = st.st_size;
+        Map();
+        while (header->ready.load(memory_order_acquire) != kReady) {
+            this_thread::yield();
+        }
+        uint64_t capacity = header->capacity;
+        if (!has_single_bit(capacity) || capacity > (bytes - sizeof(Header)) / sizeof(Cell)) {
+            munmap(header, bytes);
+            close(fd);
+            throw runtime_error("共享内存文件格式不对: " + path);
+        }
+    }
+
+    ShmRing(const ShmRing &) = delete;
+
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    ~ShmRing() {
+        munmap(header, bytes);
+        close(fd);
+        if (owner) {
+            unlink(path.c_str());
+        }
+    }
+
+    bool TryPush(uint32_t message, uint32_t sender) {
+        uint64_t mask = header->capacity - 1;
+        uint64_t pos = header->tail.load(memory_order_relaxed);
+        for (;;) {
+            Cell &cell = header->Cells()[pos & mask];
+            uint64_t seq = cell.sequence.load(memory_order_acquire);
+            int64_t diff = (int64_t) seq - (int64_t) pos;
+            if (diff == 0) {
+                if (header->tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.message = message;
+                    cell.sender = sender;
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = header->tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool TryPop(uint32_t &message, uint32_t &sender) {
+        uint64_t pos = header->head.load(memory_order_relaxed);
+        Cell &cell = header->Cells()[pos & (header->capacity - 1)];
+        if (cell.sequence.load(memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        message = cell.message;
+        sender = cell.sender;
+        cell.sequence.store(pos + header->capacity, memory_order_release);
+        header->head.store(pos + 1, memory_order_relaxed);
+        return true;
+    }
+
+private:
+    void Map() {
+        void *address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            throw runtime_error("无法映射共享内存文件: " + path);
+        }
+        header = static_cast<Header *>(address);
+    }
+
+    string path;
+    bool owner;
+    int fd = -1;
+    size_t bytes = 0;
+    Header *header = nullptr;
+};
+
+//跨进程中介者：App、Windows、Mac可以分别运行在不同进程里，每个模块编号在/dev/shm下有一个收件队列
+//接收方在本进程就直接调用AcceptMessage，否则写进对方的收件队列，快路径上没有系统调用
+//对方进程需要调用Poll取出消息派发；队列满时发送方让出CPU等待
+class ShmMediator : public AbstractMediator {
+public:
+    ShmMediator(const string &name) : name(name) {}
+
+    //登记本进程负责的模块，并创建它的收件队列
+    void SetLocalModule(uint32_t id, AbstractModule *module) {
+        if (id >= UNREGISTERED_ID) {
+            throw out_of_range("模块编号越界: " + to_string(id));
+        }
+        module->SetModuleId(id);
+        local[id] = module;
+        inboxes[id] = make_unique<ShmRing>(PathOf(id), 1024);
+    }
+
+    void Transmit(Message message, AbstractModule *pM) {
+        uint32_t sender = min<uint32_t>(pM->GetModuleId(), UNREGISTERED_ID);
+        uint32_t receiver = RouteOf(message, sender);
+        if (receiver == UNREGISTERED_ID) {
+            return;
+        }
+        if (local[receiver] != nullptr) {
+            local[receiver]->AcceptMessage(message);
+            return;
+        }
+        if (remote[receiver] == nullptr) {
+            remote[receiver] = make_unique<ShmRing>(PathOf(receiver));
+        }
+        while (!remote[receiver]->TryPush((uint32_t) message, sender)) {
+            this_thread::yield();
+        }
+    }
+
+    //派发本进程所有收件队列里的消息，返回派发的条数
+    size_t Poll() {
+        size_t count = 0;
+        uint32_t message, sender;
+        for (uint32_t id = 0; id < MODULE_ID_COUNT; ++id) {
+            if (inboxes[id] == nullptr) {
+                continue;
+            }
+            while (inboxes[id]->TryPop(message, sender)) {
+                local[id]->AcceptMessage((Message) message);
+                ++count;
+            }
+        }
+        return count;
+    }
+
+private:
+    string PathOf(uint32_t id) const {
+        return "/dev/shm/cpp24_mediator_" + name + "_" + to_string(id);
+    }
+
+    string name;
+    AbstractModule *local[MODULE_ID_COUNT] = {};
+    unique_ptr<ShmRing> inboxes[MODULE_ID_COUNT];
+    unique_ptr<ShmRing> remote[MODULE_ID_COUNT];
+};
+
+#endif
+
+void test01() {
+    AbstractMediator *pM = new ConcreteMediator;
+    //指定中介者
+    AbstractModule *app = new App(pM);
+    AbstractModule *win = new Windows(pM);
+    AbstractModule *mac = new Mac(pM);
+
+
+    //为中介者设定模块
+    ConcreteMediator *pc = dynamic_cast<ConcreteMediator *>(pM);
+    pc->SetModuleApp(app);
+    pc->SetModuleWin(win);
+    pc->SetModuleMac(mac);
+
+    //不同模块之间进行通信
+    app->SendMessage(Message::ATM_MESSAGE);
+    app->SendMessage(Message::ATW_MESSAGE);
+    win->SendMessage(Message::WTM_MESSAGE);
+}
+
+//基准测试用的模块：只计数，可以模拟耗时的处理
+template<typename Base>
+class CountingModule : public Base {
+public:
+    CountingModule(AbstractMediator *pM, int workNs = 0) : Base(pM), workNs(workNs) {}
+
+    void AcceptMessage(Message) {
+        if (workNs > 0) {
+            auto until = chrono::steady_clock::now() + chrono::nanoseconds(workNs);
+            while (chrono::steady_clock::now() < until) {}
+        }
+        received.fetch_add(1, memory_order_relaxed);
+    }
+
+    atomic<uint64_t> received{0};
+
+private:
+    int workNs;
+};
+
+//多个App线程交替发送ATM和ATW，Mac每条消息耗时200ns，统计发送方耗时和全部送达的吞吐
+template<typename Mediator>
+void BenchTransmit(const char *name, int producers, size_t perProducer) {
+    Mediator mediator;
+    CountingModule<App> app(&mediator);
+    CountingModule<Windows> win(&mediator);
+    CountingModule<Mac> mac(&mediator, 200);
+    mediator.SetModuleApp(&app);
+    mediator.SetModuleWin(&win);
+    mediator.SetModuleMac(&mac);
+    if constexpr (requires { mediator.Start(); }) {
+        mediator.Start();
+    }
+
+    atomic<bool> go{false};
+    atomic<int64_t> sendNs{0};
+    vector<thread> threads;
+    for (int i = 0; i < producers; ++i) {
+        threads.emplace_back([&] {
+            while (!go.load(memory_order_acquire)) {
+                this_thread::yield();
+            }
+            auto begin = chrono::steady_clock::now();
+            for (size_t n = 0; n < perProducer; ++n) {
+                app.SendMessage(n & 1 ? Message::ATW_MESSAGE : Message::ATM_MESSAGE);
+            }
+            sendNs.fetch_add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+        });
+    }
+
+    uint64_t total = producers * perProducer;
+    auto begin = chrono::steady_clock::now();
+    go.store(true, memory_order_release);
+    for (auto &t: threads) {
+        t.join();
+    }
+    while (win.received.load() + mac.received.load() < total) {
+        this_thread::yield();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    //模块比中介者先析构，先停掉派发线程
+    if constexpr (requires { mediator.Stop(); }) {
+        mediator.Stop();
+    }
+
+    cout << name << " 生产者:" << producers
+         << " 平均发送耗时:" << (double) sendNs.load() / total << "ns"
+         << " 送达吞吐:" << (uint64_t) (total / seconds) << "条/秒" << endl;
+}
+
+void test02() {
+    for (int producers: {1, 4, 16}) {
+        BenchTransmit<ConcreteMediator>("同步", producers, 1 << 16);
+        BenchTransmit<AsyncMediator>("异步", producers, 1 << 16);
+    }
+}
+
+//单线程测三条路由的转发速度，对比dynamic_cast和查表
+template<typename Mediator>
+void BenchRoute(const char *name, size_t count) {
+    Mediator mediator;
+    CountingModule<App> app(&mediator);
+    CountingModule<Windows> win(&mediator);
+    CountingModule<Mac> mac(&mediator);
+    mediator.SetModuleApp(&app);
+    mediator.SetModuleWin(&win);
+    mediator.SetModuleMac(&mac);
+
+    struct {
+        const char *route;
+        AbstractModule *sender;
+        Message message;
+    } cases[] = {
+            {"ATM", &app, Message::ATM_MESSAGE},
+            {"ATW", &app, Message::ATW_MESSAGE},
+            {"WTM", &win, Message::WTM_MESSAGE},
+    };
+    for (auto &c: cases) {
+        auto begin = chrono::steady_clock::now();
+        for (size_t n = 0; n < count; ++n) {
+            c.sender->SendMessage(c.message);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout << name << " " << c.route << ": " << (uint64_t) (count / seconds) << "条/秒" << endl;
+    }
+}
+
+void test03() {
+    BenchRoute<DynamicCastMediator>("dynamic_cast", 10000000);
+    BenchRoute<ConcreteMediator>("路由表", 10000000);
+}
+
+//1k个模块、10k个主题，每个模块随机订阅subscriptions个主题，随机模块向随机主题发消息
+void BenchTopic(size_t moduleCount, size_t topicCount, size_t subscriptions, size_t messageCount) {
+    TopicMediator mediator(topicCount);
+    vector<unique_ptr<CountingModule<App>>> modules;
+    for (size_t i = 0; i < moduleCount; ++i) {
+        modules.push_back(make_unique<CountingModule<App>>(&mediator));
+        mediator.Register(modules.back().get());
+    }
+
+    mt19937 rng(42);
+    uniform_int_distribution<uint32_t> pickTopic(0, topicCount - 1);
+    uniform_int_distribution<uint32_t> pickModule(0, moduleCount - 1);
+    for (auto &m: modules) {
+        for (size_t i = 0; i < subscriptions; ++i) {
+            mediator.Subscribe(m.get(), Topic(pickTopic(rng)));
+        }
+    }
+    vector<pair<uint32_t, uint32_t>> sends(messageCount);
+    for (auto &send: sends) {
+        send = {pickModule(rng), pickTopic(rng)};
+    }
+
+    auto begin = chrono::steady_clock::now();
+    for (auto &send: sends) {
+        modules[send.first]->SendMessage(Topic(send.second));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    uint64_t delivered = 0;
+    for (auto &m: modules) {
+        delivered += m->received.load();
+    }
+    cout << "模块:" << moduleCount << " 主题:" << topicCount << " 每模块订阅:" << subscriptions
+         << " 位图:" << mediator.GetBitmapBytes() / 1024 << "KB"
+         << " 发送:" << (uint64_t) (messageCount / seconds) << "条/秒"
+         << " 投递:" << (uint64_t) (delivered / seconds) << "次/秒" << endl;
+}
+
+void test04() {
+    for (size_t subscriptions: {10, 100, 1000}) {
+        BenchTopic(1000, 10000, subscriptions, 1000000);
+    }
+}
+
+//接收消息体的模块：share为true时直接读共享的消息体，否则像没有引用计数时那样每个接收方各拷贝一份
+class PayloadModule : public App {
+public:
+    PayloadModule(AbstractMediator *pM, bool share) : App(pM), share(share) {}
+
+    using App::AcceptMessage;
+
+    void AcceptMessage(const Envelope &envelope) {
+        if (share) {
+            checksum += envelope.payload.Data()[envelope.payload.Size() - 1];
+        } else {
+            vector<char> copy(envelope.payload.Data(), envelope.payload.Data() + envelope.payload.Size());
+            ++allocations;
+            bytesCopied += copy.size();
+            checksum += copy.back();
+        }
+    }
+
+    bool share;
+    uint64_t allocations = 0;
+    uint64_t bytesCopied = 0;
+    uint64_t checksum = 0;
+};
+
+//一个发送方向订阅同一主题的receivers个模块广播messageCount条带消息体的消息
+void BenchPayload(bool share, size_t payloadSize, size_t receivers, size_t messageCount) {
+    TopicMediator mediator(1);
+    PayloadArena arena(1024);
+    vector<unique_ptr<PayloadModule>> modules;
+    for (size_t i = 0; i <= receivers; ++i) {
+        modules.push_back(make_unique<PayloadModule>(&mediator, share));
+        mediator.Register(modules.back().get());
+        if (i > 0) {
+            mediator.Subscribe(modules.back().get(), Topic(0));
+        }
+    }
+    vector<char> body(payloadSize, 'x');
+
+    auto begin = chrono::steady_clock::now();
+    for (size_t n = 0; n < messageCount; ++n) {
+        modules[0]->SendMessage(Topic(0), arena.Create(body.data(), body.size()));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    PayloadArena::Stats stats = arena.GetStats();
+    uint64_t allocations = stats.slabAllocations;
+    uint64_t bytesCopied = stats.bytesCopied;
+    for (auto &m: modules) {
+        allocations += m->allocations;
+        bytesCopied += m->bytesCopied;
+    }
+    cout << (share ? "共享消息体" : "逐个拷贝") << " 大小:" << payloadSize << "B 接收方:" << receivers
+         << " 广播:" << (uint64_t) (messageCount / seconds) << "条/秒"
+         << " 堆分配:" << allocations << "次"
+         << " 拷贝:" << bytesCopied / 1024 << "KB" << endl;
+}
+
+void test05() {
+    for (size_t payloadSize: {64, 1024}) {
+        BenchPayload(false, payloadSize, 100, 100000);
+        BenchPayload(true, payloadSize, 100, 100000);
+    }
+}
+
+//统计收到的消息，单条和批量接收做同样的工作
+//接收方一般要加锁保护自己的状态，批量接收时每批只加一次锁
+//noinline模拟模块在别的编译单元里实现的情况，否则编译器会把单条路径整个内联掉
+class BatchModule : public App {
+public:
+    BatchModule(AbstractMediator *pM) : App(pM) {}
+
+    using App::AcceptMessage;
+
+    [[gnu::noinline]] void AcceptMessage(Message message) {
+        lock_guard<mutex> guard(lock);
+        checksum += (uint32_t) message;
+        ++received;
+    }
+
+    [[gnu::noinline]] void AcceptMessages(span<const Message> messages) {
+        lock_guard<mutex> guard(lock);
+        for (Message message: messages) {
+            checksum += (uint32_t) message;
+        }
+        received += messages.size();
+    }
+
+    mutex lock;
+    uint64_t checksum = 0;
+    uint64_t received = 0;
+};
+
+//App连续发出ATM和ATW交替的一串消息，对比逐条SendMessage和一次SendMessages
+void BenchBatch(size_t batchSize, size_t messageCount) {
+    ConcreteMediator mediator;
+    BatchModule app(&mediator);
+    BatchModule win(&mediator);
+    BatchModule mac(&mediator);
+    mediator.SetModuleApp(&app);
+    mediator.SetModuleWin(&win);
+    mediator.SetModuleMac(&mac);
+
+    vector<Message> burst(batchSize);
+    for (size_t i = 0; i < batchSize; ++i) {
+        burst[i] = i & 1 ? Message::ATW_MESSAGE : Message::ATM_MESSAGE;
+    }
+    size_t rounds = messageCount / batchSize;
+    //经过volatile指针调用，防止编译器把虚函数调用内联掉
+    AbstractModule *volatile sender = &app;
+
+    auto begin = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (Message message: burst) {
+            sender->SendMessage(message);
+        }
+    }
+    double single = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    begin = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        sender->SendMessages(burst);
+    }
+    double batch = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    cout << "批大小:" << batchSize
+         << " 逐条:" << (uint64_t) (rounds * batchSize / single) << "条/秒"
+         << " 批量:" << (uint64_t) (rounds * batchSize / batch) << "条/秒" << endl;
+}
+
+void test06() {
+    for (size_t batchSize = 1; batchSize <= 1024; batchSize *= 2) {
+        BenchBatch(batchSize, 1 << 22);
+    }
+}
+
+#ifdef MEDIATOR_HAS_SHM
+
+//乒乓模块：收到消息后计数，reply为true时原样回一条
+class PingModule : public App {
+public:
+    PingModule(AbstractMediator *pM, bool reply) : App(pM), reply(reply) {}
+
+    void AcceptMessage(Message message) {
+        ++received;
+        if (reply) {
+            SendMessage(message);
+        }
+    }
+
+    bool reply;
+    uint64_t received = 0;
+};
+
+//父进程扮演App，子进程扮演Windows，App发ATW给Windows，Windows再用ATW回给App
+void BenchShmPingPong(size_t rounds) {
+    string name = to_string(getpid());
+    pid_t child = fork();
+    if (child < 0) {
+        cout << "fork失败，跳过跨进程测试" << endl;
+        return;
+    }
+    if (child == 0) {
+        {
+            ShmMediator mediator(name);
+            PingModule win(&mediator, true);
+            mediator.SetLocalModule(WIN_ID, &win);
+            while (win.received < rounds) {
+                if (mediator.Poll() == 0) {
+                    this_thread::yield();
+                }
+            }
+        }
+        _exit(0);
+    }
+
+    ShmMediator mediator(name);
+    PingModule app(&mediator, false);
+    mediator.SetLocalModule(APP_ID, &app);
+    vector<double> latencies;
+    latencies.reserve(rounds);
+    for (size_t n = 0; n < rounds; ++n) {
+        auto begin = chrono::steady_clock::now();
+        app.SendMessage(Message::ATW_MESSAGE);
+        while (app.received <= n) {
+            if (mediator.Poll() == 0) {
+                this_thread::yield();
+            }
+        }
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count());
+    }
+    waitpid(child, nullptr, 0);
+
+    sort(latencies.begin(), latencies.end());
+    cout << "共享内存乒乓 往返:" << rounds
+         << " p50:" << latencies[rounds / 2] << "ns"
+         << " p99:" << latencies[rounds * 99 / 100] << "ns" << endl;
+}
+
+void test07() {
+    BenchShmPingPong(100000);
+}
+
+#else
+
+void test07() {
+    cout << "当前平台不支持共享内存中介者" << endl;
+}
+
+#endif
+
+//单线程测开启和关闭统计时每条消息的耗时，差值就是统计的开销
+template<bool Enabled>
+double BenchInstrumentation(size_t count) {
+    InstrumentedMediator<Enabled> mediator;
+    CountingModule<App> app(&mediator);
+    CountingModule<Windows> win(&mediator);
+    CountingModule<Mac> mac(&mediator);
+    mediator.SetModuleApp(&app);
+    mediator.SetModuleWin(&win);
+    mediator.SetModuleMac(&mac);
+    AbstractModule *volatile sender = &app;
+
+    auto begin = chrono::steady_clock::now();
+    for (size_t n = 0; n < count; ++n) {
+        sender->SendMessage(n & 1 ? Message::ATW_MESSAGE : Message::ATM_MESSAGE);
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / count;
+}
+
+void test08() {
+    RouteStats::Reset();
+    double disabled = BenchInstrumentation<false>(10000000);
+    double enabled = BenchInstrumentation<true>(10000000);
+    cout << "关闭统计:" << disabled << "ns/条 开启统计:" << enabled << "ns/条 开销:" << enabled - disabled << "ns/条" << endl;
+    RouteStats::Dump(cout);
+}
+
+//模拟每条消息耗时workNs的模块，同时检查是否有两个线程同时在处理它
+class SkewedModule : public App {
+public:
+    SkewedModule(AbstractMediator *pM, int workNs) : App(pM), workNs(workNs) {}
+
+    void AcceptMessage(Message) {
+        if (busy.exchange(true, memory_order_acquire)) {
+            overlaps.fetch_add(1, memory_order_relaxed);
+        }
+        auto until = chrono::steady_clock::now() + chrono::nanoseconds(workNs);
+        while (chrono::steady_clock::now() < until) {}
+        busy.store(false, memory_order_release);
+        received.fetch_add(1, memory_order_release);
+    }
+
+    int workNs;
+    atomic<bool> busy{false};
+    atomic<uint64_t> overlaps{0};
+    atomic<uint64_t> received{0};
+};
+
+//64个模块各订阅自己的主题，主题按Zipf分布被选中，前几个模块最忙
+void BenchWorkStealing(size_t workerCount, size_t moduleCount, size_t messageCount) {
+    TopicMediator mediator(moduleCount);
+    SkewedModule sender(&mediator, 0);
+    mediator.Register(&sender);
+    vector<unique_ptr<SkewedModule>> modules;
+    vector<double> weights;
+    vector<uint64_t> expected(moduleCount);
+    for (size_t i = 0; i < moduleCount; ++i) {
+        modules.push_back(make_unique<SkewedModule>(&mediator, 2000));
+        mediator.Register(modules.back().get());
+        mediator.Subscribe(modules.back().get(), Topic(i));
+        weights.push_back(1.0 / (i + 1));
+    }
+    //派发池要比模块先析构
+    WorkStealingPool pool(workerCount);
+    mediator.SetDispatchPool(&pool);
+    mt19937 rng(7);
+    discrete_distribution<uint32_t> pickTopic(weights.begin(), weights.end());
+    vector<uint32_t> topics(messageCount);
+    for (auto &topic: topics) {
+        topic = pickTopic(rng);
+        ++expected[topic];
+    }
+
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t topic: topics) {
+        sender.SendMessage(Topic(topic));
+    }
+    uint64_t delivered = 0, overlaps = 0;
+    for (size_t i = 0; i < moduleCount; ++i) {
+        while (modules[i]->received.load(memory_order_acquire) < expected[i]) {
+            this_thread::yield();
+        }
+        delivered += expected[i];
+        overlaps += modules[i]->overlaps.load();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    cout << "工作线程:" << workerCount << " 模块:" << moduleCount
+         << " 吞吐:" << (uint64_t) (delivered / seconds) << "条/秒"
+         << " 同一模块并发处理次数:" << overlaps << endl;
+}
+
+void test09() {
+    size_t cores = max(1u, thread::hardware_concurrency());
+    for (size_t workers = 1; workers < cores; workers *= 2) {
+        BenchWorkStealing(workers, 64, 200000);
+    }
+    BenchWorkStealing(cores, 64, 200000);
+}
+
+//默认只运行演示；带参数bench时运行全部基准测试，需要几十秒，test07还会fork子进程并在/dev/shm下建文件
+int main(int argc, char *argv[]) {
+    test01();
+    if (argc > 1 && string(argv[1]) == "bench") {
+        test02();
+        test03();
+        test04();
+        test05();
+        test06();
+        test07();
+        test08();
+        test09();
+    }
 }
\ No newline at end of file
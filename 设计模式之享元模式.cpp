@@ -23,6 +23,41 @@
  */
 #include "iostream"
 #include "map"
+#include "memory"
+#include "atomic"
+#include "chrono"
+#include "fstream"
+#include "string"
+#include "vector"
+#include "cstdlib"
+#include "new"
+#include "unordered_map"
+#include "string_view"
+#include "functional"
+#include "random"
+#include "charconv"
+#include "shared_mutex"
+#include "mutex"
+#include "optional"
+#include "thread"
+#include "deque"
+#include "cstring"
+#include "stdexcept"
+#include "filesystem"
+#include "array"
+#include "bit"
+
+#ifdef __linux__
+#include "unistd.h"
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#define FLYWEIGHT_HAS_MMAP 1
+#endif
 
 using namespace std;
 
@@ -38,7 +73,7 @@ public:
 
     const string &GetColor() const { return color; }
 
-    friend ostream &operator<<(ostream &out, const SharedState ss) {
+    friend ostream &operator<<(ostream &out, const SharedState &ss) {
         return out << "[" << ss.brand << "," << ss.model << "," << ss.color << "]" << endl;
     }
 
@@ -56,7 +91,7 @@ public:
 
     const string &GetPlates() const { return plates; }
 
-    friend ostream &operator<<(ostream &out, const UniqueState ss) {
+    friend ostream &operator<<(ostream &out, const UniqueState &ss) {
         return out << "[" << ss.owner << "," << ss.plates << "]" << endl;
     }
 
@@ -65,52 +100,384 @@ private:
     string plates;
 };
 
+//享元句柄：同一型号的所有句柄指向同一个不可变的SharedState，拷贝句柄只增加引用计数
 class FlyWeight {
 public:
-    FlyWeight(const SharedState *sharedState) : shared_state(new SharedState(*sharedState)) {}//内部使用的是拷贝构造
-    FlyWeight(const FlyWeight &other) : shared_state(new SharedState(*other.shared_state)) {}
+    FlyWeight(shared_ptr<const SharedState> sharedState) : shared_state(std::move(sharedState)) {}
 
-    SharedState *GetSharedState() const { return shared_state; }
+    const SharedState *GetSharedState() const { return shared_state.get(); }
 
-    void Show(const UniqueState &uniqueState) {
+    //指向同一个SharedState的句柄个数，包括工厂自己持有的那一个
+    long UseCount() const { return shared_state.use_count(); }
+
+    void Show(const UniqueState &uniqueState) const {
         cout << "共享数据:" << *shared_state << endl;
         cout << "专有数据:" << uniqueState << endl;
     }
 
 private:
-    SharedState *shared_state;
+    shared_ptr<const SharedState> shared_state;
+};
+
+//型号的键，三个字段都是视图
+//存进索引的键指向享元自己持有的SharedState，查找时直接用调用方的字符串构造，不需要拼接临时字符串
+struct FlyWeightKey {
+    string_view brand;
+    string_view model;
+    string_view color;
+
+    bool operator==(const FlyWeightKey &) const = default;
+};
+
+//FNV-1a，字段之间插一个UTF-8里不会出现的字节，避免("ab","c")和("a","bc")相同；seed用来换一组哈希值
+//编译期完美哈希表和型号目录文件共用，最后一步把高位混到低位，两边都只用低位选槽
+constexpr uint64_t FnvHash(const FlyWeightKey &key, uint64_t seed = 0) {
+    uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+    for (string_view field: {key.brand, key.model, key.color}) {
+        for (char c: field) {
+            h = (h ^ (unsigned char) c) * 0x100000001b3ull;
+        }
+        h = (h ^ 0xff) * 0x100000001b3ull;
+    }
+    return h ^ (h >> 29);
+}
+
+struct FlyWeightKeyHash {
+    size_t operator()(const FlyWeightKey &key) const {
+        hash<string_view> h;
+        size_t seed = h(key.brand);
+        seed ^= h(key.model) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+        seed ^= h(key.color) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+        return seed;
+    }
 };
 
+//默认只增不减；设置内存预算后按CLOCK策略淘汰没有外部句柄的享元
+//每个享元带一个访问位，查找命中时置位；超出预算时指针轮转，有外部句柄的跳过，访问位为1的清零给第二次机会，为0的淘汰
+//只淘汰没有外部句柄的享元，所以同一型号任何时刻最多只有一个SharedState在被使用
 class FlyWeightFactory {
 public:
     FlyWeightFactory(initializer_list<SharedState> sharedstate) {
         for (auto &v: sharedstate) {
-            this->flyweight.insert(make_pair(this->GetKey(v), FlyWeight(&v)));
+            this->Intern(v);
         }
     }
 
     FlyWeight GetFlyweight(const SharedState &sharedState) {
-        string key = this->GetKey(sharedState);
-        if (this->flyweight.find(key) == this->flyweight.end()) {
+        const FlyWeight *found = this->Find(sharedState.GetBrand(), sharedState.GetModel(), sharedState.GetColor());
+        if (found == nullptr) {
             cout << "车库未找到该型号" << endl;
-            this->flyweight.insert(make_pair(key, FlyWeight(&sharedState)));
+            FlyWeight flyweight = this->Intern(sharedState);
             cout << "入库成功" << endl;
+            return flyweight;
         } else cout << "车库找到这个型号..." << endl;
-        return this->flyweight.at(key);
+        return *found;
+    }
+
+    //查找型号，不存在时返回nullptr，整个过程不分配内存
+    //返回的指针指向工厂内部，下一次Intern、SetMemoryBudget或Trim可能把它淘汰掉，需要长期持有时复制成FlyWeight
+    const FlyWeight *Find(string_view brand, string_view model, string_view color) const {
+        auto it = this->flyweight.find({brand, model, color});
+        if (it == this->flyweight.end()) {
+            return nullptr;
+        }
+        it->second.referenced = true;
+        return &it->second.flyweight;
+    }
+
+    //不存在时入库，返回该型号唯一的享元，不输出任何信息
+    FlyWeight Intern(const SharedState &sharedState) {
+        if (const FlyWeight *found = this->Find(sharedState.GetBrand(), sharedState.GetModel(), sharedState.GetColor())) {
+            return *found;
+        }
+        FlyWeight flyweight(make_shared<const SharedState>(sharedState));
+        const SharedState *state = flyweight.GetSharedState();
+        FlyWeightKey key{state->GetBrand(), state->GetModel(), state->GetColor()};
+        size_t footprint = FootprintOf(*state);
+        this->flyweight.emplace(key, Entry{flyweight, footprint});
+        this->clock.push_back(key);
+        this->bytes += footprint;
+        this->Trim(kTrimStep);
+        return flyweight;
+    }
+
+    //设置内存预算(字节)，0表示不限制
+    void SetMemoryBudget(size_t budget) {
+        this->budget = budget;
+        this->Trim();
+    }
+
+    //把占用压回预算以内，只淘汰没有外部句柄的享元；全部都在使用时允许暂时超出预算
+    void Trim() {
+        this->Trim(2 * this->clock.size());
     }
 
     void ListFlyWeights() const {
         int count = this->flyweight.size();
         cout << "车库总信息:" << endl;
         for (auto &pair: this->flyweight) {
-            cout << pair.first << "\n";
+            cout << pair.first.brand << '_' << pair.first.model << '_' << pair.first.color << "\n";
+        }
+        cout << "型号:" << count << " 使用中:" << this->Live() << " 已淘汰:" << this->evicted
+             << " 节省字节:" << this->evictedBytes << endl;
+    }
+
+    size_t Size() const { return this->flyweight.size(); }
+
+    //还有外部句柄的享元个数
+    size_t Live() const {
+        size_t live = 0;
+        for (auto &pair: this->flyweight) {
+            live += pair.second.flyweight.UseCount() > 1;
+        }
+        return live;
+    }
+
+    size_t Evicted() const { return this->evicted; }
+
+    size_t EvictedBytes() const { return this->evictedBytes; }
+
+    //当前所有享元估算占用的字节数
+    size_t Bytes() const { return this->bytes; }
+
+    //依次访问所有享元
+    template<typename Visitor>
+    void ForEach(Visitor visitor) const {
+        for (auto &pair: this->flyweight) {
+            visitor(pair.second.flyweight);
         }
     }
 
 private:
-    map<string, FlyWeight> flyweight;
+    //Intern每次最多连续跳过这么多个不能淘汰的享元，全部都在使用时不会每次入库都把整个表扫一遍
+    static constexpr size_t kTrimStep = 8;
+
+    struct Entry {
+        FlyWeight flyweight;
+        size_t footprint;
+        mutable bool referenced = false;
+    };
+
+    //指针最多连续跳过maxScan个享元，每淘汰一个重新计数，所以一次调用最多检查(淘汰个数+1)*maxScan个享元
+    void Trim(size_t maxScan) {
+        size_t scanned = 0;
+        while (this->budget != 0 && this->bytes > this->budget && scanned < maxScan && !this->clock.empty()) {
+            if (this->hand >= this->clock.size()) {
+                this->hand = 0;
+            }
+            auto it = this->flyweight.find(this->clock[this->hand]);
+            Entry &entry = it->second;
+            if (entry.flyweight.UseCount() > 1 || entry.referenced) {
+                entry.referenced = false;
+                ++this->hand;
+                ++scanned;
+                continue;
+            }
+            this->clock[this->hand] = this->clock.back();
+            this->clock.pop_back();
+            this->bytes -= entry.footprint;
+            this->evictedBytes += entry.footprint;
+            ++this->evicted;
+            this->flyweight.erase(it);
+            scanned = 0;
+        }
+    }
 
-    string GetKey(const SharedState &ss) const { return ss.GetBrand() + '_' + ss.GetModel() + '_' + ss.GetColor(); }
+    //估算一个享元的占用：SharedState本身、超出短字符串优化的字符串缓冲区、make_shared控制块和哈希表节点
+    static size_t FootprintOf(const SharedState &state) {
+        auto heap = [](const string &s) { return s.capacity() > string().capacity() ? s.capacity() + 1 : 0; };
+        return sizeof(SharedState) + heap(state.GetBrand()) + heap(state.GetModel()) + heap(state.GetColor()) +
+               2 * sizeof(void *) + sizeof(FlyWeightKey) + sizeof(Entry) + 2 * sizeof(void *);
+    }
+
+    unordered_map<FlyWeightKey, Entry, FlyWeightKeyHash> flyweight;
+    vector<FlyWeightKey> clock;
+    size_t hand = 0;
+    size_t budget = 0;
+    size_t bytes = 0;
+    size_t evicted = 0;
+    size_t evictedBytes = 0;
+};
+
+//并发享元工厂：按键的哈希分成若干分片，每个分片一把读写锁
+//查找只拿共享锁，未命中时拿独占锁再查一次，所以同一型号的SharedState只会被创建一次
+class ConcurrentFlyWeightFactory {
+public:
+    ConcurrentFlyWeightFactory(size_t shardCount = 64) : shards(shardCount) {}
+
+    optional<FlyWeight> Find(string_view brand, string_view model, string_view color) const {
+        FlyWeightKey key{brand, model, color};
+        const Shard &shard = ShardOf(key);
+        shared_lock<shared_mutex> guard(shard.lock);
+        auto it = shard.flyweight.find(key);
+        if (it == shard.flyweight.end()) {
+            return nullopt;
+        }
+        return it->second;
+    }
+
+    //不存在时入库，多个线程同时入库同一型号时只有一个线程会创建SharedState
+    FlyWeight GetFlyweight(const SharedState &sharedState) {
+        FlyWeightKey key{sharedState.GetBrand(), sharedState.GetModel(), sharedState.GetColor()};
+        Shard &shard = ShardOf(key);
+        {
+            shared_lock<shared_mutex> guard(shard.lock);
+            auto it = shard.flyweight.find(key);
+            if (it != shard.flyweight.end()) {
+                return it->second;
+            }
+        }
+        unique_lock<shared_mutex> guard(shard.lock);
+        auto it = shard.flyweight.find(key);
+        if (it != shard.flyweight.end()) {
+            return it->second;
+        }
+        FlyWeight flyweight(make_shared<const SharedState>(sharedState));
+        const SharedState *state = flyweight.GetSharedState();
+        key = {state->GetBrand(), state->GetModel(), state->GetColor()};
+        shard.created.fetch_add(1, memory_order_relaxed);
+        return shard.flyweight.emplace(key, std::move(flyweight)).first->second;
+    }
+
+    size_t Size() const {
+        size_t size = 0;
+        for (auto &shard: shards) {
+            shared_lock<shared_mutex> guard(shard.lock);
+            size += shard.flyweight.size();
+        }
+        return size;
+    }
+
+    //创建过的SharedState个数，正常情况下等于Size()
+    size_t Created() const {
+        size_t created = 0;
+        for (auto &shard: shards) {
+            created += shard.created.load(memory_order_relaxed);
+        }
+        return created;
+    }
+
+private:
+    struct alignas(64) Shard {
+        mutable shared_mutex lock;
+        unordered_map<FlyWeightKey, FlyWeight, FlyWeightKeyHash> flyweight;
+        atomic<size_t> created{0};
+    };
+
+    //分片用哈希的高位，分片内的unordered_map用低位，两者互不相关
+    Shard &ShardOf(const FlyWeightKey &key) { return shards[(FlyWeightKeyHash()(key) >> 32) % shards.size()]; }
+
+    const Shard &ShardOf(const FlyWeightKey &key) const {
+        return shards[(FlyWeightKeyHash()(key) >> 32) % shards.size()];
+    }
+
+    vector<Shard> shards;
+};
+
+//编译期生成的完美哈希表：构建时已知的型号在编译期就确定各自的槽位，运行时查找只算一次哈希、比较一次键
+//构造函数是consteval，找不到无冲突的种子时编译失败
+template<size_t N>
+class StaticFlyWeightTable {
+public:
+    static constexpr size_t kSlots = bit_ceil(2 * N);
+
+    consteval StaticFlyWeightTable(const FlyWeightKey (&keys)[N]) {
+        for (size_t i = 0; i < N; ++i) {
+            this->keys[i] = keys[i];
+        }
+        for (this->seed = 0; this->seed < (1 << 16); ++this->seed) {
+            if (this->TryPlace()) {
+                return;
+            }
+        }
+        throw "找不到无冲突的哈希种子";
+    }
+
+    //返回型号在编译期列表里的下标，不在列表里返回N
+    constexpr size_t IndexOf(string_view brand, string_view model, string_view color) const {
+        FlyWeightKey key{brand, model, color};
+        uint32_t index = this->slots[FnvHash(key, this->seed) & (kSlots - 1)];
+        return index < N && this->keys[index] == key ? index : N;
+    }
+
+    constexpr const FlyWeightKey &Key(size_t index) const { return this->keys[index]; }
+
+    static constexpr size_t Size() { return N; }
+
+private:
+    constexpr bool TryPlace() {
+        this->slots.fill(N);
+        for (size_t i = 0; i < N; ++i) {
+            uint32_t &slot = this->slots[FnvHash(this->keys[i], this->seed) & (kSlots - 1)];
+            if (slot != N) {
+                return false;
+            }
+            slot = i;
+        }
+        return true;
+    }
+
+    array<FlyWeightKey, N> keys{};
+    array<uint32_t, kSlots> slots{};
+    uint64_t seed = 0;
+};
+
+//构建时已知的型号，和test01预置的一致
+constexpr FlyWeightKey kPresetModels[] = {
+        {"奥迪", "2023",  "red"},
+        {"奔驰", "C43",   "black"},
+        {"丰田", "AE86",  "white"},
+        {"宝马", "M6",    "blue"},
+        {"奔驰", "E",     "blue"},
+        {"奥迪", "A6",    "black"},
+        {"丰田", "Camry", "white"},
+        {"本田", "Civic", "red"},
+        {"大众", "Golf",  "grey"},
+        {"宝马", "X5",    "black"},
+};
+
+constexpr StaticFlyWeightTable kPresetTable(kPresetModels);
+static_assert(kPresetTable.IndexOf("丰田", "AE86", "white") == 2);
+static_assert(kPresetTable.IndexOf("丰田", "AE86", "red") == kPresetTable.Size());
+
+//已知型号走编译期完美哈希，其余型号交给动态的FlyWeightFactory
+//已知型号的SharedState持有string，没法在编译期构造，所以第一次用到时才创建，之后一直复用
+template<size_t N>
+class PresetFlyWeightFactory {
+public:
+    PresetFlyWeightFactory(const StaticFlyWeightTable<N> &table, FlyWeightFactory &fallback) : table(table),
+                                                                                              fallback(fallback) {}
+
+    //已知型号的指针一直有效；其余型号的指针来自fallback，同样只在它下一次Intern、SetMemoryBudget或Trim之前有效
+    const FlyWeight *Find(string_view brand, string_view model, string_view color) const {
+        size_t index = this->table.IndexOf(brand, model, color);
+        if (index == N) {
+            return this->fallback.Find(brand, model, color);
+        }
+        return &this->Preset(index);
+    }
+
+    FlyWeight Intern(const SharedState &sharedState) {
+        size_t index = this->table.IndexOf(sharedState.GetBrand(), sharedState.GetModel(), sharedState.GetColor());
+        if (index == N) {
+            return this->fallback.Intern(sharedState);
+        }
+        return this->Preset(index);
+    }
+
+private:
+    const FlyWeight &Preset(size_t index) const {
+        optional<FlyWeight> &preset = this->presets[index];
+        if (!preset) {
+            const FlyWeightKey &key = this->table.Key(index);
+            preset.emplace(make_shared<const SharedState>(string(key.brand), string(key.model), string(key.color)));
+        }
+        return *preset;
+    }
+
+    const StaticFlyWeightTable<N> &table;
+    FlyWeightFactory &fallback;
+    mutable array<optional<FlyWeight>, N> presets;
 };
 
 void AddCar(FlyWeightFactory &ff, const string &plates, const string &owner, const string &brand, const string &model,
@@ -120,6 +487,447 @@ void AddCar(FlyWeightFactory &ff, const string &plates, const string &owner, con
     flyweight.Show({owner, plates});
 }
 
+//入库线程使用的版本，不输出匹配过程
+FlyWeight AddCar(ConcurrentFlyWeightFactory &ff, const string &brand, const string &model, const string &color) {
+    return ff.GetFlyweight({brand, model, color});
+}
+
+//只读映射整个文件，不支持mmap的平台退回整个读进内存
+class MappedFile {
+public:
+    explicit MappedFile(const string &path) {
+#ifdef FLYWEIGHT_HAS_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw runtime_error("无法打开文件: " + path);
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void *address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("无法映射文件: " + path);
+            }
+            data = static_cast<const char *>(address);
+        }
+        close(fd);
+#else
+        ifstream in(path, ios::binary);
+        if (!in) {
+            throw runtime_error("无法打开文件: " + path);
+        }
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+#ifdef FLYWEIGHT_HAS_MMAP
+        if (data != nullptr) {
+            munmap(const_cast<char *>(data), size);
+        }
+#endif
+    }
+
+    const char *Data() const { return data; }
+
+    size_t Size() const { return size; }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+#ifndef FLYWEIGHT_HAS_MMAP
+    vector<char> buffer;
+#endif
+};
+
+//持久化的型号目录：把工厂里所有SharedState写成一个紧凑的二进制文件，启动时只读映射，直接在映射的页面上查找
+//文件布局：头部 | 开放寻址的桶数组(条目下标+1，0表示空) | 条目数组 | 所有字符串首尾相接
+//哈希用和编译期完美哈希表相同的FnvHash，不依赖标准库的实现，换编译器或平台生成的文件也能读
+class MappedCatalog {
+    struct Header {
+        char magic[8];
+        uint64_t count;
+        uint64_t bucketCount;
+        uint64_t entriesOffset;
+        uint64_t stringsOffset;
+        uint64_t fileSize;
+    };
+
+    struct Entry {
+        uint64_t hash;
+        uint32_t brandOffset, brandSize;
+        uint32_t modelOffset, modelSize;
+        uint32_t colorOffset, colorSize;
+    };
+
+    static constexpr char kMagic[8] = {'F', 'W', 'C', 'A', 'T', 'L', 'G', '2'};
+
+public:
+    //把工厂里的型号写进目录文件
+    static void Write(const FlyWeightFactory &factory, const string &path) {
+        uint64_t count = factory.Size();
+        uint64_t bucketCount = 1;
+        while (bucketCount < count * 2) {
+            bucketCount <<= 1;
+        }
+        vector<uint32_t> buckets(bucketCount);
+        vector<Entry> entries;
+        string strings;
+        entries.reserve(count);
+        auto append = [&](const string &value, uint32_t &offset, uint32_t &size) {
+            offset = strings.size();
+            size = value.size();
+            strings += value;
+        };
+        factory.ForEach([&](const FlyWeight &flyweight) {
+            const SharedState *state = flyweight.GetSharedState();
+            Entry entry{};
+            entry.hash = FnvHash({state->GetBrand(), state->GetModel(), state->GetColor()});
+            append(state->GetBrand(), entry.brandOffset, entry.brandSize);
+            append(state->GetModel(), entry.modelOffset, entry.modelSize);
+            append(state->GetColor(), entry.colorOffset, entry.colorSize);
+            size_t bucket = entry.hash & (bucketCount - 1);
+            while (buckets[bucket] != 0) {
+                bucket = (bucket + 1) & (bucketCount - 1);
+            }
+            entries.push_back(entry);
+            buckets[bucket] = entries.size();
+        });
+
+        Header header{};
+        memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.count = count;
+        header.bucketCount = bucketCount;
+        header.entriesOffset = sizeof(Header) + bucketCount * sizeof(uint32_t);
+        header.entriesOffset = (header.entriesOffset + alignof(Entry) - 1) / alignof(Entry) * alignof(Entry);
+        header.stringsOffset = header.entriesOffset + count * sizeof(Entry);
+        header.fileSize = header.stringsOffset + strings.size();
+
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(buckets.data()), buckets.size() * sizeof(uint32_t));
+        //对齐用的空隙写0，不能seekp：后面没有内容时文件会比fileSize短
+        const char padding[alignof(Entry)] = {};
+        out.write(padding, header.entriesOffset - sizeof(header) - buckets.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(Entry));
+        out.write(strings.data(), strings.size());
+        if (!out) {
+            throw runtime_error("无法写入型号目录: " + path);
+        }
+    }
+
+    //文件被截断或损坏时抛出runtime_error：检查头部各段的范围、桶和条目里的所有下标和字符串范围，
+    //之后的查找不会读出映射范围；检查要扫一遍桶和条目，但不读字符串内容
+    explicit MappedCatalog(const string &path) : file(path) {
+        const char *data = file.Data();
+        uint64_t size = file.Size();
+        header = reinterpret_cast<const Header *>(data);
+        auto fail = [&] { throw runtime_error("型号目录格式不对: " + path); };
+        if (size < sizeof(Header) || memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->fileSize != size) {
+            fail();
+        }
+        //桶数必须是2的幂且至少留一个空桶，否则查找不会停下来
+        uint64_t bucketCount = header->bucketCount, count = header->count;
+        if (bucketCount == 0 || (bucketCount & (bucketCount - 1)) != 0 || count >= bucketCount ||
+            bucketCount > (size - sizeof(Header)) / sizeof(uint32_t)) {
+            fail();
+        }
+        uint64_t entriesOffset = header->entriesOffset, stringsOffset = header->stringsOffset;
+        if (entriesOffset < sizeof(Header) + bucketCount * sizeof(uint32_t) || entriesOffset % alignof(Entry) != 0 ||
+            entriesOffset > size || count > (size - entriesOffset) / sizeof(Entry) ||
+            stringsOffset < entriesOffset + count * sizeof(Entry) || stringsOffset > size) {
+            fail();
+        }
+        buckets = reinterpret_cast<const uint32_t *>(data + sizeof(Header));
+        entries = reinterpret_cast<const Entry *>(data + entriesOffset);
+        strings = data + stringsOffset;
+
+        uint64_t stringsSize = size - stringsOffset;
+        for (uint64_t b = 0; b < bucketCount; ++b) {
+            if (buckets[b] > count) {
+                fail();
+            }
+        }
+        auto inRange = [&](uint32_t offset, uint32_t length) { return (uint64_t) offset + length <= stringsSize; };
+        for (uint64_t i = 0; i < count; ++i) {
+            const Entry &entry = entries[i];
+            if (!inRange(entry.brandOffset, entry.brandSize) || !inRange(entry.modelOffset, entry.modelSize) ||
+                !inRange(entry.colorOffset, entry.colorSize)) {
+                fail();
+            }
+        }
+    }
+
+    //找到时返回指向映射页面的键
+    optional<FlyWeightKey> Find(string_view brand, string_view model, string_view color) const {
+        uint64_t hash = FnvHash({brand, model, color});
+        uint64_t mask = header->bucketCount - 1;
+        for (uint64_t bucket = hash & mask; buckets[bucket] != 0; bucket = (bucket + 1) & mask) {
+            const Entry &entry = entries[buckets[bucket] - 1];
+            if (entry.hash == hash) {
+                FlyWeightKey key = KeyOf(entry);
+                if (key == FlyWeightKey{brand, model, color}) {
+                    return key;
+                }
+            }
+        }
+        return nullopt;
+    }
+
+    size_t Size() const { return header->count; }
+
+private:
+    FlyWeightKey KeyOf(const Entry &entry) const {
+        return {{strings + entry.brandOffset, entry.brandSize},
+                {strings + entry.modelOffset, entry.modelSize},
+                {strings + entry.colorOffset, entry.colorSize}};
+    }
+
+    MappedFile file;
+    const Header *header = nullptr;
+    const uint32_t *buckets = nullptr;
+    const Entry *entries = nullptr;
+    const char *strings = nullptr;
+};
+
+//字符串字典：每个不同的字符串只存一份，对外用从0开始的连续编号表示
+class StringDictionary {
+public:
+    uint32_t Intern(string_view value) {
+        auto it = ids.find(value);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        values.emplace_back(value);
+        return ids.emplace(values.back(), values.size() - 1).first->second;
+    }
+
+    optional<uint32_t> Find(string_view value) const {
+        auto it = ids.find(value);
+        return it != ids.end() ? optional<uint32_t>(it->second) : nullopt;
+    }
+
+    string_view Lookup(uint32_t id) const { return values[id]; }
+
+    size_t Size() const { return values.size(); }
+
+private:
+    deque<string> values;   //deque扩容时不移动已有元素，ids里的视图一直有效
+    unordered_map<string_view, uint32_t> ids;
+};
+
+//变长字符串列：所有字符串首尾相接放在一块内存里，另用一个数组记录每个字符串的结束位置
+class StringColumn {
+public:
+    void Append(string_view value) {
+        chars.append(value);
+        ends.push_back(chars.size());
+    }
+
+    string_view operator[](size_t row) const {
+        size_t begin = row == 0 ? 0 : ends[row - 1];
+        return string_view(chars).substr(begin, ends[row] - begin);
+    }
+
+    void Reserve(size_t rows, size_t bytesPerRow) {
+        chars.reserve(rows * bytesPerRow);
+        ends.reserve(rows);
+    }
+
+    size_t Bytes() const { return chars.capacity() + ends.capacity() * sizeof(uint64_t); }
+
+private:
+    string chars;
+    vector<uint64_t> ends;
+};
+
+//列式车辆表：品牌、型号、颜色用字典编码成整数列，车主和车牌放在字符串列里
+//按品牌统计之类的扫描只需要顺序读一个整数数组
+class CarTable {
+public:
+    void Reserve(size_t rows) {
+        brandIds.reserve(rows);
+        modelIds.reserve(rows);
+        colorIds.reserve(rows);
+        owners.Reserve(rows, 12);
+        plates.Reserve(rows, 12);
+    }
+
+    void AddCar(string_view plate, string_view owner, string_view brand, string_view model, string_view color) {
+        brandIds.push_back(brands.Intern(brand));
+        modelIds.push_back(models.Intern(model));
+        colorIds.push_back(colors.Intern(color));
+        owners.Append(owner);
+        plates.Append(plate);
+    }
+
+    //第row辆车的共享数据和专有数据
+    SharedState GetSharedState(size_t row) const {
+        return {string(brands.Lookup(brandIds[row])), string(models.Lookup(modelIds[row])),
+                string(colors.Lookup(colorIds[row]))};
+    }
+
+    UniqueState GetUniqueState(size_t row) const {
+        return {string(owners[row]), string(plates[row])};
+    }
+
+    //下标是品牌编号，用BrandName换回品牌名
+    vector<size_t> CountByBrand() const {
+        vector<size_t> counts(brands.Size());
+        for (uint32_t id: brandIds) {
+            ++counts[id];
+        }
+        return counts;
+    }
+
+    string_view BrandName(uint32_t id) const { return brands.Lookup(id); }
+
+    size_t Size() const { return brandIds.size(); }
+
+private:
+    StringDictionary brands;
+    StringDictionary models;
+    StringDictionary colors;
+    vector<uint32_t> brandIds;
+    vector<uint32_t> modelIds;
+    vector<uint32_t> colorIds;
+    StringColumn owners;
+    StringColumn plates;
+};
+
+//批量入库的结果：每个不同型号一个享元句柄，第i行对应flyweights[rows[i]]
+struct IngestResult {
+    vector<FlyWeight> flyweights;
+    vector<uint32_t> rows;
+    size_t badRows = 0;
+
+    const FlyWeight &Row(size_t i) const { return flyweights[rows[i]]; }
+};
+
+//从CSV文件批量入库，每行格式为 车牌,车主,品牌,型号,颜色，第一行是表头
+//文件按行边界切成threadCount块并行解析，每个线程先在本地对型号去重(键直接指向映射的文件内容)，
+//最后由一个线程把各线程的去重结果合并进工厂，再并行把本地编号换成全局编号；整个过程不输出任何信息
+//threadCount为0时按1处理
+IngestResult IngestCsv(FlyWeightFactory &factory, const string &path, size_t threadCount) {
+    threadCount = max<size_t>(1, threadCount);
+    MappedFile file(path);
+    const char *begin = file.Data(), *end = begin + file.Size();
+    const char *firstRow = begin != nullptr ? static_cast<const char *>(memchr(begin, '\n', end - begin)) : nullptr;
+    firstRow = firstRow != nullptr ? firstRow + 1 : end;
+
+    //每块的起点向后移到下一行开头
+    vector<const char *> bounds{firstRow};
+    for (size_t t = 1; t < threadCount; ++t) {
+        const char *p = max(bounds.back(), firstRow + (end - firstRow) * t / threadCount);
+        const char *newline = p < end ? static_cast<const char *>(memchr(p, '\n', end - p)) : nullptr;
+        bounds.push_back(newline != nullptr ? newline + 1 : end);
+    }
+    bounds.push_back(end);
+
+    struct Local {
+        unordered_map<FlyWeightKey, uint32_t, FlyWeightKeyHash> ids;
+        vector<FlyWeightKey> keys;
+        vector<uint32_t> rows;
+        vector<uint32_t> toGlobal;
+        size_t badRows = 0;
+    };
+    vector<Local> locals(threadCount);
+    auto parse = [&](size_t t) {
+        Local &local = locals[t];
+        const char *p = bounds[t];
+        while (p < bounds[t + 1]) {
+            const char *lineEnd = static_cast<const char *>(memchr(p, '\n', bounds[t + 1] - p));
+            if (lineEnd == nullptr) {
+                lineEnd = bounds[t + 1];
+            }
+            const char *next = lineEnd + 1;
+            if (lineEnd > p && lineEnd[-1] == '\r') {
+                --lineEnd;
+            }
+            //字段数必须正好是5，多一列或少一列都算坏行
+            string_view fields[5];
+            size_t n = 0;
+            for (const char *field = p; n <= 5; ++n) {
+                const char *comma = static_cast<const char *>(memchr(field, ',', lineEnd - field));
+                if (n < 5) {
+                    fields[n] = {field, (size_t) ((comma != nullptr ? comma : lineEnd) - field)};
+                }
+                if (comma == nullptr) {
+                    ++n;
+                    break;
+                }
+                field = comma + 1;
+            }
+            if (n != 5) {
+                local.badRows += lineEnd > p;
+                p = next;
+                continue;
+            }
+            p = next;
+            FlyWeightKey key{fields[2], fields[3], fields[4]};
+            auto [it, inserted] = local.ids.try_emplace(key, local.keys.size());
+            if (inserted) {
+                local.keys.push_back(key);
+            }
+            local.rows.push_back(it->second);
+        }
+    };
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back(parse, t);
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    //合并：每个不同型号只入库一次
+    IngestResult result;
+    unordered_map<FlyWeightKey, uint32_t, FlyWeightKeyHash> globalIds;
+    vector<size_t> rowOffsets{0};
+    for (Local &local: locals) {
+        local.toGlobal.reserve(local.keys.size());
+        for (const FlyWeightKey &key: local.keys) {
+            auto it = globalIds.find(key);
+            if (it == globalIds.end()) {
+                FlyWeight flyweight = factory.Intern({string(key.brand), string(key.model), string(key.color)});
+                const SharedState *state = flyweight.GetSharedState();
+                FlyWeightKey stable{state->GetBrand(), state->GetModel(), state->GetColor()};
+                it = globalIds.emplace(stable, result.flyweights.size()).first;
+                result.flyweights.push_back(std::move(flyweight));
+            }
+            local.toGlobal.push_back(it->second);
+        }
+        rowOffsets.push_back(rowOffsets.back() + local.rows.size());
+        result.badRows += local.badRows;
+    }
+
+    result.rows.resize(rowOffsets.back());
+    threads.clear();
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t] {
+            uint32_t *out = result.rows.data() + rowOffsets[t];
+            for (uint32_t id: locals[t].rows) {
+                *out++ = locals[t].toGlobal[id];
+            }
+            vector<uint32_t>().swap(locals[t].rows);
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    return result;
+}
+
 void test01() {
     FlyWeightFactory *f = new FlyWeightFactory(
             {
@@ -134,6 +942,573 @@ void test01() {
     delete f;
 }
 
-int main() {
+//统计堆分配次数，基准测试用
+//替换了全部不带对齐参数的operator new/delete，数组版本和nothrow版本都走同一对malloc/free
+//operator delete不允许内联：GCC把它内联进调用方后，会把free和标准operator new配对而报-Wmismatched-new-delete
+#if defined(__GNUC__)
+#define FLYWEIGHT_NOINLINE __attribute__((noinline))
+#else
+#define FLYWEIGHT_NOINLINE
+#endif
+
+static atomic<size_t> allocationCount{0};
+
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    if (void *p = malloc(size != 0 ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    return malloc(size != 0 ? size : 1);
+}
+
+void *operator new[](size_t size, const nothrow_t &tag) noexcept {
+    return operator new(size, tag);
+}
+
+FLYWEIGHT_NOINLINE void operator delete(void *p) noexcept {
+    free(p);
+}
+
+FLYWEIGHT_NOINLINE void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+FLYWEIGHT_NOINLINE void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+FLYWEIGHT_NOINLINE void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+FLYWEIGHT_NOINLINE void operator delete(void *p, const nothrow_t &) noexcept {
+    free(p);
+}
+
+FLYWEIGHT_NOINLINE void operator delete[](void *p, const nothrow_t &) noexcept {
+    free(p);
+}
+
+//当前进程的常驻内存(KB)，只在Linux上读得到
+size_t CurrentRssKB() {
+#ifdef __linux__
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE) / 1024;
+#else
+    return 0;
+#endif
+}
+
+//原来的实现：构造和拷贝享元时都深拷贝一份SharedState且从不释放，保留下来作为对照
+class DeepCopyFlyWeight {
+public:
+    DeepCopyFlyWeight(const SharedState *sharedState) : shared_state(new SharedState(*sharedState)) {}
+
+    DeepCopyFlyWeight(const DeepCopyFlyWeight &other) : shared_state(new SharedState(*other.shared_state)) {}
+
+    void Show(const UniqueState &uniqueState) {
+        cout << "共享数据:" << *shared_state << endl;
+        cout << "专有数据:" << uniqueState << endl;
+    }
+
+private:
+    SharedState *shared_state;
+};
+
+class DeepCopyFlyWeightFactory {
+public:
+    DeepCopyFlyWeight GetFlyweight(const SharedState &sharedState) {
+        string key = sharedState.GetBrand() + '_' + sharedState.GetModel() + '_' + sharedState.GetColor();
+        if (this->flyweight.find(key) == this->flyweight.end()) {
+            cout << "车库未找到该型号" << endl;
+            this->flyweight.insert(make_pair(key, DeepCopyFlyWeight(&sharedState)));
+            cout << "入库成功" << endl;
+        } else cout << "车库找到这个型号..." << endl;
+        return this->flyweight.at(key);
+    }
+
+private:
+    map<string, DeepCopyFlyWeight> flyweight;
+};
+
+void AddCar(DeepCopyFlyWeightFactory &ff, const string &plates, const string &owner, const string &brand,
+            const string &model, const string &color) {
+    cout << "车型匹配结果" << endl;
+    auto flyweight = ff.GetFlyweight({brand, model, color});
+    flyweight.Show({owner, plates});
+}
+
+//调用count次AddCar，车型在models个型号里循环，屏蔽输出后统计耗时、堆分配次数和常驻内存增量
+template<typename Factory>
+void BenchAddCar(const char *name, size_t count, size_t models) {
+    vector<string> modelNames;
+    for (size_t i = 0; i < models; ++i) {
+        modelNames.push_back("Model-" + to_string(i));
+    }
+    size_t rssBefore = CurrentRssKB();
+    size_t allocationsBefore = allocationCount.load();
+    auto begin = chrono::steady_clock::now();
+    {
+        Factory factory{};
+        streambuf *console = cout.rdbuf(nullptr);
+        for (size_t i = 0; i < count; ++i) {
+            AddCar(factory, "京A00001", "cmx", "奔驰", modelNames[i % models], "black");
+        }
+        cout.rdbuf(console);
+        cout.clear();
+        cout << name << " AddCar:" << count
+             << " 耗时:" << chrono::duration<double>(chrono::steady_clock::now() - begin).count() << "s"
+             << " 堆分配:" << allocationCount.load() - allocationsBefore << "次"
+             << " 常驻内存增量:" << (CurrentRssKB() - rssBefore) / 1024 << "MB" << endl;
+    }
+}
+
+void test02() {
+    BenchAddCar<FlyWeightFactory>("共享句柄", 10000000, 1000);
+    BenchAddCar<DeepCopyFlyWeightFactory>("深拷贝", 10000000, 1000);
+}
+
+//把编号写成型号名，写进调用方的缓冲区，不分配内存
+string_view ModelName(size_t id, char (&buffer)[32]) {
+    buffer[0] = 'M';
+    char *end = to_chars(buffer + 1, buffer + sizeof(buffer), id).ptr;
+    return {buffer, (size_t) (end - buffer)};
+}
+
+//在models个型号里做lookups次命中查找和未命中查找，对比原来拼接字符串后查std::map的做法
+void BenchLookup(size_t models, size_t lookups) {
+    char buffer[32];
+    mt19937_64 rng(1);
+    vector<size_t> hits(lookups), misses(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        hits[i] = rng() % models;
+        misses[i] = models + rng() % models;
+    }
+    auto measure = [&](const vector<size_t> &ids, auto &&lookup) {
+        size_t found = 0, allocationsBefore = allocationCount.load();
+        auto begin = chrono::steady_clock::now();
+        for (size_t id: ids) {
+            found += lookup(ModelName(id, buffer));
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / ids.size();
+        cout << " " << ns << "ns/次(" << (double) (allocationCount.load() - allocationsBefore) / ids.size() << "次分配,命中"
+             << found << ")";
+    };
+
+    {
+        FlyWeightFactory factory{};
+        for (size_t i = 0; i < models; ++i) {
+            factory.Intern({"奔驰", string(ModelName(i, buffer)), "black"});
+        }
+        auto lookup = [&](string_view model) { return factory.Find("奔驰", model, "black") != nullptr; };
+        cout << "型号:" << models << " 哈希索引 命中:";
+        measure(hits, lookup);
+        cout << " 未命中:";
+        measure(misses, lookup);
+        cout << endl;
+    }
+    {
+        map<string, int> index;
+        for (size_t i = 0; i < models; ++i) {
+            index.emplace(string("奔驰") + '_' + string(ModelName(i, buffer)) + '_' + "black", 0);
+        }
+        auto lookup = [&](string_view model) {
+            return index.find(string("奔驰") + '_' + string(model) + '_' + "black") != index.end();
+        };
+        cout << "型号:" << models << " 拼接+map 命中:";
+        measure(hits, lookup);
+        cout << " 未命中:";
+        measure(misses, lookup);
+        cout << endl;
+    }
+}
+
+void test03() {
+    for (size_t models: {1000, 100000, 10000000}) {
+        BenchLookup(models, 1000000);
+    }
+}
+
+//用一把互斥锁保护的普通工厂，作为并发工厂的对照
+class LockedFlyWeightFactory {
+public:
+    FlyWeight GetFlyweight(const SharedState &sharedState) {
+        lock_guard<mutex> guard(lock);
+        return factory.Intern(sharedState);
+    }
+
+    size_t Size() const { return factory.Size(); }
+
+private:
+    mutex lock;
+    FlyWeightFactory factory{};
+};
+
+//预先入库100k个型号，每个线程做ops次GetFlyweight，其中missPercent%是从没见过的新型号
+template<typename Factory>
+void BenchConcurrentFactory(const char *name, size_t threadCount, size_t missPercent, size_t ops) {
+    const size_t models = 100000;
+    Factory factory;
+    char buffer[32];
+    for (size_t i = 0; i < models; ++i) {
+        factory.GetFlyweight({"奔驰", string(ModelName(i, buffer)), "black"});
+    }
+
+    vector<thread> threads;
+    atomic<bool> go{false};
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t] {
+            char buffer[32];
+            mt19937_64 rng(t);
+            size_t nextNew = models + t * ops;
+            while (!go.load(memory_order_acquire)) {
+                this_thread::yield();
+            }
+            for (size_t i = 0; i < ops; ++i) {
+                size_t id = rng() % 100 < missPercent ? nextNew++ : rng() % models;
+                factory.GetFlyweight({"奔驰", string(ModelName(id, buffer)), "black"});
+            }
+        });
+    }
+    auto begin = chrono::steady_clock::now();
+    go.store(true, memory_order_release);
+    for (auto &t: threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << name << " 线程:" << threadCount << " 命中/未命中:" << 100 - missPercent << "/" << missPercent
+         << " 吞吐:" << (uint64_t) (threadCount * ops / seconds) << "次/秒"
+         << " 型号数:" << factory.Size() << endl;
+}
+
+void test04() {
+    for (size_t missPercent: {10, 1}) {
+        for (size_t threadCount: {1, 2, 4, 8}) {
+            BenchConcurrentFactory<LockedFlyWeightFactory>("单锁工厂", threadCount, missPercent, 200000);
+            BenchConcurrentFactory<ConcurrentFlyWeightFactory>("分片工厂", threadCount, missPercent, 200000);
+        }
+    }
+    //多个线程同时入库同一批新型号，每个SharedState只应创建一次
+    ConcurrentFlyWeightFactory factory;
+    vector<thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            char buffer[32];
+            for (size_t i = 0; i < 10000; ++i) {
+                factory.GetFlyweight({"丰田", string(ModelName(i, buffer)), "white"});
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    cout << "4个线程入库同一批10000个型号 型号数:" << factory.Size() << " 创建SharedState:" << factory.Created() << endl;
+}
+
+//cars辆车分别存成"享元+专有数据"的行和列式车辆表，对比每辆车的内存和按品牌统计的扫描速度
+void BenchCarTable(size_t cars) {
+    const char *brandNames[] = {"奥迪", "奔驰", "丰田", "宝马", "本田", "大众", "福特", "日产"};
+    const char *colorNames[] = {"red", "black", "white", "blue", "grey"};
+    auto owner = [](size_t i) { return "车主" + to_string(i % 1000000); };
+    auto plate = [](size_t i) { return "京A" + to_string(100000 + i % 900000); };
+    char buffer[32];
+
+    size_t rssBefore = CurrentRssKB();
+    {
+        FlyWeightFactory factory{};
+        vector<pair<FlyWeight, UniqueState>> rows;
+        rows.reserve(cars);
+        for (size_t i = 0; i < cars; ++i) {
+            FlyWeight flyweight = factory.Intern({brandNames[i % 8], string(ModelName(i % 1000, buffer)), colorNames[i % 5]});
+            rows.emplace_back(flyweight, UniqueState(owner(i), plate(i)));
+        }
+        double bytesPerCar = (CurrentRssKB() - rssBefore) * 1024.0 / cars;
+
+        auto begin = chrono::steady_clock::now();
+        unordered_map<string_view, size_t> counts;
+        for (auto &row: rows) {
+            ++counts[row.first.GetSharedState()->GetBrand()];
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout << "享元+专有数据 车辆:" << cars << " 每辆车:" << bytesPerCar << "B"
+             << " 按品牌统计:" << (uint64_t) (cars / seconds) << "行/秒 品牌数:" << counts.size() << endl;
+    }
+
+    rssBefore = CurrentRssKB();
+    {
+        CarTable table;
+        table.Reserve(cars);
+        for (size_t i = 0; i < cars; ++i) {
+            table.AddCar(plate(i), owner(i), brandNames[i % 8], ModelName(i % 1000, buffer), colorNames[i % 5]);
+        }
+        double bytesPerCar = (CurrentRssKB() - rssBefore) * 1024.0 / cars;
+
+        auto begin = chrono::steady_clock::now();
+        vector<size_t> counts = table.CountByBrand();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout << "列式车辆表 车辆:" << cars << " 每辆车:" << bytesPerCar << "B"
+             << " 按品牌统计:" << (uint64_t) (cars / seconds) << "行/秒 品牌数:" << counts.size()
+             << " " << table.BrandName(0) << ":" << counts[0] << endl;
+    }
+}
+
+void test05() {
+    BenchCarTable(10000000);
+}
+
+//models个型号的目录：从SharedState列表重建工厂，和映射已保存的目录文件，对比启动耗时和常驻内存
+void BenchCatalog(size_t models) {
+    char buffer[32];
+    string path = (filesystem::temp_directory_path() / "flyweight_catalog.bin").string();
+    vector<SharedState> source;
+    source.reserve(models);
+    for (size_t i = 0; i < models; ++i) {
+        source.push_back({"奔驰", string(ModelName(i, buffer)), "black"});
+    }
+    auto lookupAll = [&](auto &&find) {
+        size_t found = 0;
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < models; ++i) {
+            found += find(ModelName(i, buffer));
+        }
+        return make_pair(found, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
+    };
+
+    {
+        size_t rssBefore = CurrentRssKB();
+        auto begin = chrono::steady_clock::now();
+        FlyWeightFactory factory{};
+        for (auto &state: source) {
+            factory.Intern(state);
+        }
+        double startup = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        size_t rss = CurrentRssKB() - rssBefore;
+        auto [found, seconds] = lookupAll([&](string_view model) {
+            return factory.Find("奔驰", model, "black") != nullptr;
+        });
+        cout << "重建工厂 型号:" << models << " 启动:" << startup * 1000 << "ms 常驻内存:" << rss / 1024
+             << "MB 全部查找一遍:" << seconds * 1000 << "ms 命中:" << found << endl;
+        MappedCatalog::Write(factory, path);
+    }
+    {
+        size_t rssBefore = CurrentRssKB();
+        auto begin = chrono::steady_clock::now();
+        MappedCatalog catalog(path);
+        double startup = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        size_t rss = CurrentRssKB() - rssBefore;
+        auto [found, seconds] = lookupAll([&](string_view model) {
+            return catalog.Find("奔驰", model, "black").has_value();
+        });
+        cout << "映射目录 型号:" << catalog.Size() << " 启动:" << startup * 1000 << "ms 常驻内存:" << rss / 1024
+             << "MB(查找后" << (CurrentRssKB() - rssBefore) / 1024 << "MB) 全部查找一遍:" << seconds * 1000
+             << "ms 命中:" << found << endl;
+    }
+    filesystem::remove(path);
+}
+
+void test06() {
+    //空工厂写出的目录也要能打开
+    string path = (filesystem::temp_directory_path() / "flyweight_empty_catalog.bin").string();
+    FlyWeightFactory empty{};
+    MappedCatalog::Write(empty, path);
+    {
+        MappedCatalog catalog(path);
+        cout << "空目录 型号:" << catalog.Size() << " 命中:" << catalog.Find("奔驰", "C43", "black").has_value() << endl;
+    }
+    filesystem::remove(path);
+
+    BenchCatalog(1000000);
+}
+
+//生成rows行的CSV，型号在8个品牌*1000个型号*5种颜色里循环
+void WriteSyntheticCsv(const string &path, size_t rows) {
+    const char *brandNames[] = {"奥迪", "奔驰", "丰田", "宝马", "本田", "大众", "福特", "日产"};
+    const char *colorNames[] = {"red", "black", "white", "blue", "grey"};
+    ofstream out(path, ios::binary | ios::trunc);
+    out << "plates,owner,brand,model,color\n";
+    string chunk;
+    char buffer[32];
+    for (size_t i = 0; i < rows; ++i) {
+        chunk += "京A";
+        chunk += to_string(100000 + i % 900000);
+        chunk += ",车主";
+        chunk += to_string(i % 1000000);
+        chunk += ',';
+        chunk += brandNames[i % 8];
+        chunk += ',';
+        chunk += ModelName(i / 8 % 1000, buffer);
+        chunk += ',';
+        chunk += colorNames[i / 8000 % 5];
+        chunk += '\n';
+        if (chunk.size() > (1 << 20)) {
+            out << chunk;
+            chunk.clear();
+        }
+    }
+    out << chunk;
+}
+
+//对比逐条AddCar(屏蔽输出)和并行批量入库
+void BenchIngest(size_t rows) {
+    string path = (filesystem::temp_directory_path() / "flyweight_cars.csv").string();
+    WriteSyntheticCsv(path, rows);
+    size_t threadCount = max(1u, thread::hardware_concurrency());
+
+    {
+        MappedFile file(path);
+        string_view text(file.Data(), file.Size());
+        size_t sample = min<size_t>(rows, 1000000), done = 0, pos = text.find('\n') + 1;
+        FlyWeightFactory factory{};
+        streambuf *console = cout.rdbuf(nullptr);
+        auto begin = chrono::steady_clock::now();
+        string fields[5];
+        for (; done < sample; ++done) {
+            for (size_t n = 0; n < 5; ++n) {
+                size_t stop = text.find(n < 4 ? ',' : '\n', pos);
+                fields[n].assign(text.substr(pos, stop - pos));
+                pos = stop + 1;
+            }
+            AddCar(factory, fields[0], fields[1], fields[2], fields[3], fields[4]);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout.rdbuf(console);
+        cout.clear();
+        cout << "逐条AddCar 行数:" << sample << " 吞吐:" << (uint64_t) (sample / seconds) << "行/秒" << endl;
+    }
+    for (size_t threads: {(size_t) 1, threadCount}) {
+        FlyWeightFactory factory{};
+        auto begin = chrono::steady_clock::now();
+        IngestResult result = IngestCsv(factory, path, threads);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout << "批量入库 线程:" << threads << " 行数:" << result.rows.size() << " 型号:" << result.flyweights.size()
+             << " 吞吐:" << (uint64_t) (result.rows.size() / seconds) << "行/秒"
+             << " 最后一行:" << *result.Row(result.rows.size() - 1).GetSharedState();
+        if (threads == threadCount) {
+            break;
+        }
+    }
+    filesystem::remove(path);
+}
+
+void test07() {
+    BenchIngest(50000000);
+}
+
+//型号集合随时间轮换：始终持有最近window个型号的句柄，每步入库一个新型号、放掉最老的一个，再随机查一次仍在使用的型号
+void BenchChurn(const char *name, size_t budget, size_t steps, size_t window) {
+    mt19937_64 rng(1);
+    size_t rssBefore = CurrentRssKB();
+    auto begin = chrono::steady_clock::now();
+    FlyWeightFactory factory{};
+    factory.SetMemoryBudget(budget);
+    deque<FlyWeight> active;
+    string model;
+    for (size_t i = 0; i < steps; ++i) {
+        model = "Model-Generation-" + to_string(i);
+        active.push_back(factory.Intern({"奔驰", model, "black"}));
+        if (active.size() > window) {
+            active.pop_front();
+        }
+        model = "Model-Generation-" + to_string(i - rng() % active.size());
+        factory.Find("奔驰", model, "black");
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << name << " 步数:" << steps << " 耗时:" << seconds << "s 型号:" << factory.Size()
+         << " 使用中:" << factory.Live() << " 已淘汰:" << factory.Evicted()
+         << " 占用:" << factory.Bytes() / 1024 << "KB 节省:" << factory.EvictedBytes() / 1024 << "KB"
+         << " 常驻内存增量:" << (CurrentRssKB() - rssBefore) / 1024 << "MB" << endl;
+}
+
+void test08() {
+    //预算只够一个型号时，放掉句柄的型号会在下次入库时被淘汰
+    FlyWeightFactory factory{};
+    factory.SetMemoryBudget(1);
+    FlyWeight audi = factory.Intern({"奥迪", "A6", "black"});
+    factory.Intern({"奔驰", "C200", "red"});
+    factory.Intern({"丰田", "Camry", "white"});
+    factory.ListFlyWeights();
+
+    BenchChurn("不限制", 0, 2000000, 1000);
+    BenchChurn("预算1MB", 1 << 20, 2000000, 1000);
+}
+
+//对比已知型号走编译期完美哈希和走运行时填充的哈希索引：启动耗时和查找延迟
+void BenchPresetLookup(size_t lookups) {
+    //查找用的键在运行时拷贝出来，避免编译器直接把查找算完
+    vector<string> fields;
+    for (const FlyWeightKey &key: kPresetModels) {
+        fields.insert(fields.end(), {string(key.brand), string(key.model), string(key.color)});
+    }
+    fields.insert(fields.end(), {"奔驰", "S500", "black"});
+    mt19937_64 rng(1);
+    vector<FlyWeightKey> known(lookups), unknown(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        size_t k = rng() % kPresetTable.Size();
+        known[i] = {fields[3 * k], fields[3 * k + 1], fields[3 * k + 2]};
+        unknown[i] = {fields[fields.size() - 3], fields[fields.size() - 2], fields[fields.size() - 1]};
+    }
+    auto measure = [&](const char *name, const vector<FlyWeightKey> &keys, auto &factory) {
+        size_t found = 0;
+        auto begin = chrono::steady_clock::now();
+        for (const FlyWeightKey &key: keys) {
+            found += factory.Find(key.brand, key.model, key.color) != nullptr;
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / keys.size();
+        cout << name << " " << ns << "ns/次(命中" << found << ")" << endl;
+    };
+
+    auto begin = chrono::steady_clock::now();
+    FlyWeightFactory runtime{};
+    for (const FlyWeightKey &key: kPresetModels) {
+        runtime.Intern({string(key.brand), string(key.model), string(key.color)});
+    }
+    double runtimeStartup = chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+
+    begin = chrono::steady_clock::now();
+    FlyWeightFactory fallback{};
+    fallback.Intern({"奔驰", "S500", "black"});
+    PresetFlyWeightFactory preset(kPresetTable, fallback);
+    double presetStartup = chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+
+    cout << "型号:" << kPresetTable.Size() << " 启动 运行时填充:" << runtimeStartup << "us 编译期表(含一个回退型号):"
+         << presetStartup << "us" << endl;
+    measure("运行时哈希索引 已知型号", known, runtime);
+    measure("编译期完美哈希 已知型号", known, preset);
+    measure("编译期完美哈希 回退型号", unknown, preset);
+}
+
+void test09() {
+    FlyWeightFactory fallback{};
+    PresetFlyWeightFactory factory(kPresetTable, fallback);
+    factory.Intern({"丰田", "AE86", "white"}).Show({"cmx", "2023"});
+    factory.Intern({"奔驰", "S500", "black"}).Show({"cmx", "2024"});
+    fallback.ListFlyWeights();
+
+    BenchPresetLookup(10000000);
+}
+
+//默认只运行演示；带参数bench时运行全部基准测试，需要几分钟、几GB内存，test07还会在临时目录写约2GB的CSV
+int main(int argc, char *argv[]) {
     test01();
+    if (argc > 1 && string(argv[1]) == "bench") {
+        test02();
+        test03();
+        test04();
+        test05();
+        test06();
+        test07();
+        test08();
+        test09();
+    }
 }
\ No newline at end of file
@@ -25,32 +25,1142 @@
  */
 #include "iostream"
 #include "string"
+#include "atomic"
+#include "chrono"
+#include "thread"
+#include "mutex"
+#include "list"
+#include "map"
+#include "unordered_map"
+#include "vector"
+#include "random"
+#include "functional"
+#include "optional"
+#include "memory"
+#include "future"
+#include "algorithm"
+#include "barrier"
+#include "semaphore"
+#include "condition_variable"
+#include "deque"
+#include "stop_token"
+#include "stdexcept"
+#include "cstring"
+#include "array"
+#include "bit"
+#include "ostream"
+#include "fstream"
+#include "filesystem"
+#include "cerrno"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include "unistd.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "sys/uio.h"
+#include "sys/wait.h"
+#define PROXY_HAS_UNIX_SOCKET 1
+#endif
 
 using namespace std;
 
+//一次购票查询：出发地、目的地、日期
+struct TicketQuery {
+    string from;
+    string to;
+    string date;
+
+    bool operator==(const TicketQuery &) const = default;
+};
+
+struct TicketQueryHash {
+    size_t operator()(const TicketQuery &query) const {
+        hash<string> h;
+        size_t seed = h(query.from);
+        seed ^= h(query.to) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+        seed ^= h(query.date) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+        return seed;
+    }
+};
+
+//查询结果，serial是后端处理这次查询时的调用序号，soldOut表示这趟车已经没有余票
+struct Ticket {
+    string route;
+    int price = 0;
+    size_t serial = 0;
+    bool soldOut = false;
+};
+
+//一趟车的余票：座位数分散到若干个各占一条缓存行的原子计数里
+//购票先在当前线程固定对应的分片上做"大于0才减一"，这个分片卖完了再依次去其他分片找；每次成功的减一都对应一个真实座位，所以不会超卖
+class SeatInventory {
+public:
+    SeatInventory(int64_t seats, size_t shardCount = 16) : shards(shardCount) {
+        for (size_t i = 0; i < shardCount; ++i) {
+            shards[i].seats.store(seats / (int64_t) shardCount + (i < (size_t) (seats % (int64_t) shardCount)),
+                                  memory_order_relaxed);
+        }
+    }
+
+    bool TryAcquire() {
+        static thread_local size_t home = hash<thread::id>()(this_thread::get_id());
+        for (size_t i = 0; i < shards.size(); ++i) {
+            atomic<int64_t> &seats = shards[(home + i) % shards.size()].seats;
+            int64_t left = seats.load(memory_order_relaxed);
+            while (left > 0) {
+                if (seats.compare_exchange_weak(left, left - 1, memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    //并发购票时只是一个近似值
+    int64_t Remaining() const {
+        int64_t left = 0;
+        for (auto &shard: shards) {
+            left += shard.seats.load(memory_order_relaxed);
+        }
+        return left;
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<int64_t> seats{0};
+    };
+
+    vector<Shard> shards;
+};
+
+//所有车次的余票，车次在开售前全部加好，之后只读，查找不需要加锁
+class TicketInventory {
+public:
+    void AddTrain(const string &route, int64_t seats) {
+        trains.emplace(route, make_unique<SeatInventory>(seats));
+    }
+
+    SeatInventory *Find(const string &route) const {
+        auto it = trains.find(route);
+        return it != trains.end() ? it->second.get() : nullptr;
+    }
+
+private:
+    unordered_map<string, unique_ptr<SeatInventory>> trains;
+};
+
 class AbstractSubject {
 public:
+    virtual ~AbstractSubject() = default;
+
     virtual void PurchaseTicket() = 0;
+
+    virtual Ticket PurchaseTicket(const TicketQuery &query) = 0;
+
+    //批量查询，默认逐个调用；后端支持批量时应该重写
+    virtual vector<Ticket> PurchaseTickets(const vector<TicketQuery> &queries) {
+        vector<Ticket> tickets;
+        tickets.reserve(queries.size());
+        for (auto &query: queries) {
+            tickets.push_back(this->PurchaseTicket(query));
+        }
+        return tickets;
+    }
 };
 
+//真实主题：每次查询都要访问后端，latency模拟后端的处理耗时
+//给了余票库存时，购票要从对应车次扣一个座位，车次不存在或卖完了返回soldOut；这时每次调用都有副作用，不能经Ctrip、SingleFlightProxy调用
 class User : public AbstractSubject {
 public:
+    User(chrono::microseconds latency = chrono::microseconds(0), TicketInventory *inventory = nullptr)
+            : latency(latency), inventory(inventory) {}
+
     void PurchaseTicket() {
         cout << "用户买票" << endl;
     }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        size_t serial = this->calls.fetch_add(1, memory_order_relaxed) + 1;
+        if (this->latency.count() > 0) {
+            this_thread::sleep_for(this->latency);
+        }
+        return this->Issue(query, serial);
+    }
+
+    //一次批量调用只付一次后端耗时，也只算一次调用
+    vector<Ticket> PurchaseTickets(const vector<TicketQuery> &queries) {
+        size_t serial = this->calls.fetch_add(1, memory_order_relaxed) + 1;
+        if (this->latency.count() > 0) {
+            this_thread::sleep_for(this->latency);
+        }
+        vector<Ticket> tickets;
+        tickets.reserve(queries.size());
+        for (auto &query: queries) {
+            tickets.push_back(this->Issue(query, serial));
+        }
+        return tickets;
+    }
+
+    //后端被调用的次数
+    size_t Calls() const { return this->calls.load(memory_order_relaxed); }
+
+private:
+    Ticket Issue(const TicketQuery &query, size_t serial) {
+        Ticket ticket{query.from + "-" + query.to + " " + query.date, (int) (TicketQueryHash()(query) % 900 + 100),
+                      serial};
+        if (this->inventory != nullptr) {
+            SeatInventory *seats = this->inventory->Find(ticket.route);
+            ticket.soldOut = seats == nullptr || !seats->TryAcquire();
+        }
+        return ticket;
+    }
+
+    chrono::microseconds latency;
+    TicketInventory *inventory;
+    atomic<size_t> calls{0};
 };
 
+//缓存代理：按查询缓存后端的结果，每条结果有存活时间，每个分片各自按LRU淘汰
+//分片按查询的哈希选，每个分片一把锁；访问后端时不持锁，同一查询并发未命中时可能都访问后端，结果以后写入的为准
+//缓存把查询当成没有副作用的票价、余票查询，同一个结果会交给很多调用方，soldOut也会一直保留到过期
+//所以不能放在带余票库存的User前面：那样一个座位会发给多个买家，真正的购票要直接(或经批量、异步代理)访问后端
 class Ctrip : public AbstractSubject {
 public:
-    Ctrip(AbstractSubject*base):pBase(base){}
+    Ctrip(AbstractSubject *base, size_t capacity = 4096, chrono::milliseconds ttl = chrono::seconds(60),
+          size_t shardCount = 16) : pBase(base), ttl(ttl), shards(shardCount),
+                                    shardCapacity(max<size_t>(1, capacity / shardCount)) {}
+
     void PurchaseTicket() {
         cout << "携程购票" << endl;
+        pBase->PurchaseTicket();
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        Shard &shard = this->shards[TicketQueryHash()(query) % this->shards.size()];
+        auto now = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> guard(shard.lock);
+            auto it = shard.index.find(query);
+            if (it != shard.index.end()) {
+                if (it->second->expires > now) {
+                    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                    this->hits.fetch_add(1, memory_order_relaxed);
+                    return it->second->ticket;
+                }
+                shard.lru.erase(it->second);
+                shard.index.erase(it);
+            }
+        }
+        this->misses.fetch_add(1, memory_order_relaxed);
+        Ticket ticket = pBase->PurchaseTicket(query);
+
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.index.find(query);
+        if (it != shard.index.end()) {
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+        }
+        shard.lru.push_front({query, ticket, chrono::steady_clock::now() + this->ttl});
+        shard.index.emplace(query, shard.lru.begin());
+        if (shard.lru.size() > this->shardCapacity) {
+            shard.index.erase(shard.lru.back().query);
+            shard.lru.pop_back();
+        }
+        return ticket;
     }
 
+    size_t Hits() const { return this->hits.load(memory_order_relaxed); }
+
+    size_t Misses() const { return this->misses.load(memory_order_relaxed); }
+
+private:
+    struct Entry {
+        TicketQuery query;
+        Ticket ticket;
+        chrono::steady_clock::time_point expires;
+    };
+
+    struct alignas(64) Shard {
+        mutex lock;
+        list<Entry> lru;
+        unordered_map<TicketQuery, list<Entry>::iterator, TicketQueryHash> index;
+    };
+
+    AbstractSubject *pBase;
+    chrono::milliseconds ttl;
+    vector<Shard> shards;
+    size_t shardCapacity;
+    atomic<size_t> hits{0};
+    atomic<size_t> misses{0};
+};
+
+//合并请求的代理：同一查询同时只有一次后端调用在进行，期间到达的相同查询等待这次调用并共享它的结果(包括异常)
+//和Ctrip一样只适合没有副作用的查询，不能放在带余票库存的User前面，否则同时到达的买家会拿到同一个座位
+class SingleFlightProxy : public AbstractSubject {
+public:
+    SingleFlightProxy(AbstractSubject *base) : pBase(base) {}
+
+    void PurchaseTicket() {
+        pBase->PurchaseTicket();
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        promise<Ticket> result;
+        shared_future<Ticket> flight;
+        bool leader;
+        {
+            lock_guard<mutex> guard(this->lock);
+            auto it = this->inflight.find(query);
+            leader = it == this->inflight.end();
+            if (leader) {
+                flight = result.get_future().share();
+                this->inflight.emplace(query, flight);
+            } else {
+                flight = it->second;
+            }
+        }
+        if (!leader) {
+            this->coalesced.fetch_add(1, memory_order_relaxed);
+            return flight.get();
+        }
+        try {
+            result.set_value(pBase->PurchaseTicket(query));
+        } catch (...) {
+            result.set_exception(current_exception());
+        }
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->inflight.erase(query);
+        }
+        return flight.get();
+    }
+
+    //等待别人的调用而没有访问后端的次数
+    size_t Coalesced() const { return this->coalesced.load(memory_order_relaxed); }
+
 private:
     AbstractSubject *pBase;
+    mutex lock;
+    unordered_map<TicketQuery, shared_future<Ticket>, TicketQueryHash> inflight;
+    atomic<size_t> coalesced{0};
 };
 
+//批量代理：把各线程的单个查询攒起来，攒够maxBatch个或最早的查询等了maxDelay后，由后台线程一次批量调用后端
+//每个调用方拿到自己那一个查询的future；后端抛出异常或返回的结果个数不对时整批的future都得到异常
+class BatchingProxy : public AbstractSubject {
+public:
+    BatchingProxy(AbstractSubject *base, size_t maxBatch, chrono::microseconds maxDelay) : pBase(base),
+                                                                                          maxBatch(maxBatch),
+                                                                                          maxDelay(maxDelay) {
+        this->flusher = thread(&BatchingProxy::Run, this);
+    }
+
+    //停止前把还没发出的查询都发出去
+    ~BatchingProxy() {
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->stopping = true;
+        }
+        this->wake.notify_one();
+        this->flusher.join();
+    }
+
+    void PurchaseTicket() {
+        pBase->PurchaseTicket();
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        return this->PurchaseTicketAsync(query).get();
+    }
+
+    future<Ticket> PurchaseTicketAsync(const TicketQuery &query) {
+        future<Ticket> result;
+        bool notify;
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->pending.push_back({query, {}, chrono::steady_clock::now()});
+            result = this->pending.back().result.get_future();
+            //第一个查询到达时要开始计时，攒满时要立即发出
+            notify = this->pending.size() == 1 || this->pending.size() == this->maxBatch;
+        }
+        if (notify) {
+            this->wake.notify_one();
+        }
+        return result;
+    }
+
+    size_t Batches() const { return this->batches.load(memory_order_relaxed); }
+
+private:
+    struct Pending {
+        TicketQuery query;
+        promise<Ticket> result;
+        chrono::steady_clock::time_point enqueued;
+    };
+
+    void Run() {
+        unique_lock<mutex> guard(this->lock);
+        while (true) {
+            this->wake.wait(guard, [this] { return this->stopping || !this->pending.empty(); });
+            if (this->pending.empty()) {
+                return;
+            }
+            this->wake.wait_until(guard, this->pending.front().enqueued + this->maxDelay, [this] {
+                return this->stopping || this->pending.size() >= this->maxBatch;
+            });
+            vector<Pending> batch;
+            size_t count = min(this->pending.size(), this->maxBatch);
+            batch.insert(batch.end(), make_move_iterator(this->pending.begin()),
+                         make_move_iterator(this->pending.begin() + count));
+            this->pending.erase(this->pending.begin(), this->pending.begin() + count);
+            guard.unlock();
+            this->Flush(batch);
+            guard.lock();
+        }
+    }
+
+    void Flush(vector<Pending> &batch) {
+        vector<TicketQuery> queries;
+        queries.reserve(batch.size());
+        for (auto &p: batch) {
+            queries.push_back(std::move(p.query));
+        }
+        this->batches.fetch_add(1, memory_order_relaxed);
+        try {
+            vector<Ticket> tickets = pBase->PurchaseTickets(queries);
+            if (tickets.size() != batch.size()) {
+                throw runtime_error("批量调用返回的结果个数不对");
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                batch[i].result.set_value(std::move(tickets[i]));
+            }
+        } catch (...) {
+            for (auto &p: batch) {
+                p.result.set_exception(current_exception());
+            }
+        }
+    }
+
+    AbstractSubject *pBase;
+    size_t maxBatch;
+    chrono::microseconds maxDelay;
+    mutex lock;
+    condition_variable wake;
+    vector<Pending> pending;
+    bool stopping = false;
+    atomic<size_t> batches{0};
+    thread flusher;
+};
+
+class TicketCancelled : public runtime_error {
+public:
+    TicketCancelled() : runtime_error("购票已取消") {}
+};
+
+class TicketDeadlineExceeded : public runtime_error {
+public:
+    TicketDeadlineExceeded() : runtime_error("购票超时") {}
+};
+
+//异步代理：调用放进有界队列，由固定个数的工作线程调用后端，调用方立即拿到future
+//队列满时提交方阻塞，以此限制同时在途的调用数；开始调用后端前检查取消和截止时间，
+//后端调用一旦开始就不能中断，它可能已经扣了座位，所以即使返回时超过了截止时间也照常交付结果
+class AsyncProxy : public AbstractSubject {
+public:
+    AsyncProxy(AbstractSubject *base, size_t workerCount, size_t queueCapacity) : pBase(base),
+                                                                                  queueCapacity(queueCapacity) {
+        for (size_t i = 0; i < workerCount; ++i) {
+            this->workers.emplace_back(&AsyncProxy::Run, this);
+        }
+    }
+
+    //已经提交的调用都执行完才返回
+    ~AsyncProxy() {
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->stopping = true;
+        }
+        this->notEmpty.notify_all();
+        for (auto &worker: this->workers) {
+            worker.join();
+        }
+    }
+
+    void PurchaseTicket() {
+        pBase->PurchaseTicket();
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        return this->PurchaseTicketAsync(query).get();
+    }
+
+    future<Ticket> PurchaseTicketAsync(const TicketQuery &query,
+                                       chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max(),
+                                       stop_token cancel = {}) {
+        Job job{query, {}, deadline, std::move(cancel)};
+        future<Ticket> result = job.result.get_future();
+        {
+            unique_lock<mutex> guard(this->lock);
+            this->notFull.wait(guard, [this] { return this->queue.size() < this->queueCapacity; });
+            this->queue.push_back(std::move(job));
+        }
+        this->notEmpty.notify_one();
+        return result;
+    }
+
+private:
+    struct Job {
+        TicketQuery query;
+        promise<Ticket> result;
+        chrono::steady_clock::time_point deadline;
+        stop_token cancel;
+    };
+
+    void Run() {
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> guard(this->lock);
+                this->notEmpty.wait(guard, [this] { return this->stopping || !this->queue.empty(); });
+                if (this->queue.empty()) {
+                    return;
+                }
+                job = std::move(this->queue.front());
+                this->queue.pop_front();
+            }
+            this->notFull.notify_one();
+            try {
+                if (job.cancel.stop_requested()) {
+                    throw TicketCancelled();
+                }
+                if (chrono::steady_clock::now() >= job.deadline) {
+                    throw TicketDeadlineExceeded();
+                }
+                job.result.set_value(pBase->PurchaseTicket(job.query));
+            } catch (...) {
+                job.result.set_exception(current_exception());
+            }
+        }
+    }
+
+    AbstractSubject *pBase;
+    size_t queueCapacity;
+    mutex lock;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<Job> queue;
+    bool stopping = false;
+    vector<thread> workers;
+};
+
+//虚代理：真实主题构造代价大时，推迟到第一次购票才构造；prewarm为true时一开始就在后台线程构造，第一次购票只需等它完成
+//后台构造抛出异常时忽略，call_once不会记为完成，第一次购票会重新构造，失败时异常交给购票的调用方
+class LazyProxy : public AbstractSubject {
+public:
+    LazyProxy(function<unique_ptr<AbstractSubject>()> factory, bool prewarm = false) : factory(std::move(factory)) {
+        if (prewarm) {
+            this->warmer = thread([this] {
+                try {
+                    this->Subject();
+                } catch (...) {
+                }
+            });
+        }
+    }
+
+    ~LazyProxy() {
+        if (this->warmer.joinable()) {
+            this->warmer.join();
+        }
+    }
+
+    void PurchaseTicket() {
+        this->Subject()->PurchaseTicket();
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        return this->Subject()->PurchaseTicket(query);
+    }
+
+    bool Constructed() const { return this->subject.load(memory_order_acquire) != nullptr; }
+
+private:
+    //构造完成后只是一次原子读
+    AbstractSubject *Subject() {
+        AbstractSubject *subject = this->subject.load(memory_order_acquire);
+        if (subject != nullptr) {
+            return subject;
+        }
+        call_once(this->once, [this] {
+            this->owned = this->factory();
+            this->subject.store(this->owned.get(), memory_order_release);
+        });
+        return this->owned.get();
+    }
+
+    function<unique_ptr<AbstractSubject>()> factory;
+    once_flag once;
+    unique_ptr<AbstractSubject> owned;
+    atomic<AbstractSubject *> subject{nullptr};
+    thread warmer;
+};
+
+//每个方法的调用次数和耗时直方图，第i个桶统计耗时在[2^(i-1), 2^i)纳秒的调用
+struct MethodStats {
+    uint64_t calls = 0;
+    uint64_t totalNs = 0;
+    array<uint64_t, 64> buckets{};
+
+    void Add(uint64_t ns) {
+        ++calls;
+        totalNs += ns;
+        ++buckets[bit_width(ns)];
+    }
+
+    void Merge(const MethodStats &other) {
+        calls += other.calls;
+        totalNs += other.totalNs;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i] += other.buckets[i];
+        }
+    }
+
+    //返回分位数所在桶的上界
+    uint64_t Percentile(double p) const {
+        uint64_t target = (uint64_t) (calls * p), seen = 0;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen > target) {
+                return i == 0 ? 0 : (1ull << i) - 1;
+            }
+        }
+        return 0;
+    }
+};
+
+//所有线程的调用记录。每个线程写自己的缓冲区，记录时不加锁；
+//汇总和导出只应在被测线程都结束或停下之后调用
+class TraceRegistry {
+public:
+    struct Event {
+        const char *name;
+        uint64_t beginNs;
+        uint64_t durationNs;
+    };
+
+    struct ThreadBuffer {
+        uint32_t tid;
+        vector<Event> events;
+        unordered_map<const char *, MethodStats> stats;
+        //上一次记录的方法，连续调用同一方法时不用查表
+        const char *lastName = nullptr;
+        MethodStats *lastStats = nullptr;
+    };
+
+    //每个线程最多保留这么多条事件，超出后只计入直方图
+    static constexpr size_t kMaxEventsPerThread = 1 << 20;
+
+    static TraceRegistry &Instance() {
+        static TraceRegistry registry;
+        return registry;
+    }
+
+    void Record(const char *name, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end) {
+        ThreadBuffer &buffer = this->Local();
+        uint64_t beginNs = chrono::duration_cast<chrono::nanoseconds>(begin - this->origin).count();
+        uint64_t durationNs = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+        if (name != buffer.lastName) {
+            buffer.lastName = name;
+            buffer.lastStats = &buffer.stats[name];
+        }
+        buffer.lastStats->Add(durationNs);
+        if (this->recordEvents && buffer.events.size() < kMaxEventsPerThread) {
+            buffer.events.push_back({name, beginNs, durationNs});
+        }
+    }
+
+    //关闭后只统计直方图，不保留逐条事件
+    void SetRecordEvents(bool enabled) { this->recordEvents = enabled; }
+
+    //按方法名合并所有线程的统计
+    map<string, MethodStats> Summary() {
+        lock_guard<mutex> guard(this->lock);
+        map<string, MethodStats> summary;
+        for (auto &buffer: this->buffers) {
+            for (auto &[name, stats]: buffer->stats) {
+                summary[name].Merge(stats);
+            }
+        }
+        return summary;
+    }
+
+    void PrintSummary(ostream &out) {
+        for (auto &[name, stats]: this->Summary()) {
+            out << name << " 调用:" << stats.calls << " 平均:" << stats.totalNs / max<uint64_t>(1, stats.calls)
+                << "ns p50<=" << stats.Percentile(0.5) << "ns p99<=" << stats.Percentile(0.99) << "ns" << endl;
+        }
+    }
+
+    //导出为chrome://tracing和Perfetto能打开的JSON，每次调用是一个完整事件(ph为X)，时间单位是微秒
+    void WriteChromeTrace(ostream &out) {
+        lock_guard<mutex> guard(this->lock);
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for (auto &buffer: this->buffers) {
+            for (auto &event: buffer->events) {
+                out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                    << buffer->tid << ",\"ts\":" << event.beginNs / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0
+                    << "}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    void Clear() {
+        lock_guard<mutex> guard(this->lock);
+        for (auto &buffer: this->buffers) {
+            buffer->events.clear();
+            buffer->stats.clear();
+            buffer->lastName = nullptr;
+            buffer->lastStats = nullptr;
+        }
+    }
+
+private:
+    //缓冲区由注册表持有，线程退出后数据仍然可以导出
+    ThreadBuffer &Local() {
+        thread_local ThreadBuffer *local = nullptr;
+        if (local == nullptr) {
+            lock_guard<mutex> guard(this->lock);
+            this->buffers.push_back(make_unique<ThreadBuffer>());
+            local = this->buffers.back().get();
+            local->tid = this->buffers.size();
+        }
+        return *local;
+    }
+
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    atomic<bool> recordEvents{true};
+    mutex lock;
+    vector<unique_ptr<ThreadBuffer>> buffers;
+};
+
+//计时代理，适用于任何接口，不需要为每个接口手写转发：
+//traced->Method(...)先由operator->返回一个计时对象，再由它的operator->转发给真实对象，
+//计时对象在整个调用表达式结束时析构并记录耗时。traced("名字")->Method(...)按给定的方法名分别统计，
+//不给名字时记在构造时给的名字下；名字需要是字符串字面量这样长期有效的字符串
+template<typename Interface>
+class Traced {
+public:
+    class Call {
+    public:
+        Call(Interface *target, const char *name) : target(target), name(name),
+                                                    begin(chrono::steady_clock::now()) {}
+
+        Call(const Call &) = delete;
+
+        Call &operator=(const Call &) = delete;
+
+        ~Call() {
+            TraceRegistry::Instance().Record(this->name, this->begin, chrono::steady_clock::now());
+        }
+
+        Interface *operator->() const { return this->target; }
+
+    private:
+        Interface *target;
+        const char *name;
+        chrono::steady_clock::time_point begin;
+    };
+
+    Traced(Interface *target, const char *name) : target(target), name(name) {}
+
+    Call operator->() const { return {this->target, this->name}; }
+
+    Call operator()(const char *method) const { return {this->target, method}; }
+
+private:
+    Interface *target;
+    const char *name;
+};
+
+#ifdef PROXY_HAS_UNIX_SOCKET
+
+//远程调用的帧格式，整数都是本机字节序(两端在同一台机器上)，每帧前4字节是后面内容的长度，内容最长kMaxFrame字节
+//请求: 长度u32 请求号u32 出发地长度u16 出发地 目的地长度u16 目的地 日期长度u16 日期
+//应答: 长度u32 请求号u32 票价i32 调用序号u64 无票u8 线路长度u32 线路
+namespace wire {
+    constexpr size_t kMaxFrame = 1 << 20;
+
+    class FormatError : public runtime_error {
+    public:
+        FormatError() : runtime_error("远程调用帧格式错误") {}
+    };
+
+    template<typename T>
+    void Put(string &out, T value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    //从帧里读一个整数，剩下的字节不够时抛出FormatError
+    template<typename T>
+    T Get(const char *&p, const char *end) {
+        if ((size_t) (end - p) < sizeof(T)) {
+            throw FormatError();
+        }
+        T value;
+        memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        return value;
+    }
+
+    //读一个长度为Length类型的字段，字段超出帧尾时抛出FormatError
+    template<typename Length>
+    string_view GetField(const char *&p, const char *end) {
+        Length length = Get<Length>(p, end);
+        if ((size_t) (end - p) < length) {
+            throw FormatError();
+        }
+        string_view field(p, length);
+        p += length;
+        return field;
+    }
+
+    //写完整个iovec数组，处理部分写入和被信号打断，失败返回false
+    bool WriteAll(int fd, iovec *iov, int count) {
+        while (count > 0) {
+            ssize_t written = writev(fd, iov, min(count, 1024));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            while (count > 0 && (size_t) written >= iov->iov_len) {
+                written -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+    //累积读到的字节，取出完整的帧；缓冲区一直复用，只在遇到更大的帧时扩容
+    class FrameReader {
+    public:
+        FrameReader() : buffer(64 * 1024) {}
+
+        //返回下一个完整帧(不含长度字段)，连接关闭、出错或帧长超过kMaxFrame返回false
+        bool Next(int fd, string_view &frame) {
+            this->Consume();
+            while (true) {
+                size_t available = this->end - this->begin;
+                if (available >= 4) {
+                    size_t length = this->Length();
+                    if (length > kMaxFrame) {
+                        return false;
+                    }
+                    if (available >= 4 + length) {
+                        frame = {this->buffer.data() + this->begin + 4, length};
+                        this->pending = 4 + length;
+                        return true;
+                    }
+                    if (4 + length > this->buffer.size()) {
+                        this->buffer.resize(4 + length);
+                    }
+                }
+                if (this->end == this->buffer.size()) {
+                    memmove(this->buffer.data(), this->buffer.data() + this->begin, available);
+                    this->begin = 0;
+                    this->end = available;
+                }
+                ssize_t n = read(fd, this->buffer.data() + this->end, this->buffer.size() - this->end);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                this->end += n;
+            }
+        }
+
+        //缓冲区里还有没处理完的完整帧时为true，服务端据此决定是否先把应答写出去
+        bool HasFrame() {
+            this->Consume();
+            size_t available = this->end - this->begin;
+            return available >= 4 && this->Length() <= kMaxFrame && available >= 4 + this->Length();
+        }
+
+    private:
+        //当前帧的长度字段，调用前缓冲区里至少要有4个字节；转成size_t后再加4不会溢出
+        size_t Length() const {
+            uint32_t length;
+            memcpy(&length, this->buffer.data() + this->begin, 4);
+            return length;
+        }
+
+        void Consume() {
+            this->begin += this->pending;
+            this->pending = 0;
+            if (this->begin == this->end) {
+                this->begin = this->end = 0;
+            }
+        }
+
+        vector<char> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+        size_t pending = 0;
+    };
+
+    sockaddr_un Address(const string &path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw runtime_error("套接字路径过长: " + path);
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+}
+
+//服务端存根：在UNIX域套接字上接收请求帧，调用本进程里的真实主题，把应答帧写回
+//同一连接上流水线发来的请求按顺序处理，读到的请求都处理完才一次写出所有应答
+class TicketServer {
+public:
+    TicketServer(AbstractSubject *subject, const string &path) : subject(subject), path(path) {
+        sockaddr_un address = wire::Address(path);
+        unlink(path.c_str());
+        this->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (this->listener < 0 || ::bind(this->listener, (sockaddr *) &address, sizeof(address)) != 0 ||
+            listen(this->listener, 16) != 0) {
+            if (this->listener >= 0) {
+                close(this->listener);
+            }
+            throw runtime_error("无法监听: " + path);
+        }
+    }
+
+    TicketServer(const TicketServer &) = delete;
+
+    TicketServer &operator=(const TicketServer &) = delete;
+
+    ~TicketServer() {
+        close(this->listener);
+        unlink(this->path.c_str());
+    }
+
+    //依次服务connections个连接，每个连接直到对方关闭
+    void Serve(size_t connections) {
+        for (size_t i = 0; i < connections; ++i) {
+            int fd = accept(this->listener, nullptr, nullptr);
+            if (fd < 0 && errno == EINTR) {
+                --i;
+                continue;
+            }
+            if (fd < 0) {
+                return;
+            }
+            this->ServeConnection(fd);
+            close(fd);
+        }
+    }
+
+private:
+    void ServeConnection(int fd) {
+        wire::FrameReader reader;
+        string out;
+        string_view frame;
+        TicketQuery query;
+        while (reader.Next(fd, frame)) {
+            const char *p = frame.data(), *end = p + frame.size();
+            uint32_t id;
+            try {
+                id = wire::Get<uint32_t>(p, end);
+                query.from = wire::GetField<uint16_t>(p, end);
+                query.to = wire::GetField<uint16_t>(p, end);
+                query.date = wire::GetField<uint16_t>(p, end);
+            } catch (const wire::FormatError &) {
+                return;
+            }
+            Ticket ticket = this->subject->PurchaseTicket(query);
+
+            size_t length = 4 + 4 + 8 + 1 + 4 + ticket.route.size();
+            if (length > wire::kMaxFrame) {
+                return;
+            }
+            wire::Put<uint32_t>(out, length);
+            wire::Put<uint32_t>(out, id);
+            wire::Put<int32_t>(out, ticket.price);
+            wire::Put<uint64_t>(out, ticket.serial);
+            wire::Put<uint8_t>(out, ticket.soldOut);
+            wire::Put<uint32_t>(out, ticket.route.size());
+            out += ticket.route;
+            if (!reader.HasFrame()) {
+                iovec iov{out.data(), out.size()};
+                if (!wire::WriteAll(fd, &iov, 1)) {
+                    return;
+                }
+                out.clear();
+            }
+        }
+    }
+
+    AbstractSubject *subject;
+    string path;
+    int listener = -1;
+};
+
+//远程代理：把购票请求编码成帧发给另一个进程里的TicketServer
+//请求的各个字段直接作为iovec用writev发出，不拷贝；批量购票时一次发出一组请求再依次读应答
+//帧头、iovec和读缓冲区都在对象里复用，一个代理同时只允许一个调用，多线程使用时串行；收发出错后连接作废，之后的调用都抛出异常
+class RemoteProxy : public AbstractSubject {
+public:
+    static constexpr size_t kWindow = 128;
+
+    RemoteProxy(const string &path) : headers(kWindow), iov(6 * kWindow) {
+        sockaddr_un address = wire::Address(path);
+        this->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (this->fd < 0 || connect(this->fd, (sockaddr *) &address, sizeof(address)) != 0) {
+            if (this->fd >= 0) {
+                close(this->fd);
+            }
+            throw runtime_error("无法连接: " + path);
+        }
+    }
+
+    RemoteProxy(const RemoteProxy &) = delete;
+
+    RemoteProxy &operator=(const RemoteProxy &) = delete;
+
+    ~RemoteProxy() {
+        if (this->fd >= 0) {
+            close(this->fd);
+        }
+    }
+
+    void PurchaseTicket() {
+        cout << "远程购票" << endl;
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        lock_guard<mutex> guard(this->lock);
+        Validate(&query, 1);
+        Ticket ticket;
+        this->Exchange([&] {
+            this->Send(&query, 1);
+            this->Receive(ticket);
+        });
+        return ticket;
+    }
+
+    //流水线：每次最多发出kWindow个请求再读它们的应答，避免两端的套接字缓冲区都写满后互相等待
+    vector<Ticket> PurchaseTickets(const vector<TicketQuery> &queries) {
+        lock_guard<mutex> guard(this->lock);
+        Validate(queries.data(), queries.size());
+        vector<Ticket> tickets(queries.size());
+        this->Exchange([&] {
+            for (size_t begin = 0; begin < queries.size(); begin += kWindow) {
+                size_t count = min(kWindow, queries.size() - begin);
+                this->Send(queries.data() + begin, count);
+                for (size_t i = 0; i < count; ++i) {
+                    this->Receive(tickets[begin + i]);
+                }
+            }
+        });
+        return tickets;
+    }
+
+private:
+    //帧长、请求号和出发地长度连在一起，后两个长度各自单独一段
+    struct Header {
+        char head[10];
+        char toLength[2];
+        char dateLength[2];
+    };
+
+    //字段长度只有16位，发送前先检查整批，不合法时什么都不发，连接也不受影响
+    static void Validate(const TicketQuery *queries, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (max({queries[i].from.size(), queries[i].to.size(), queries[i].date.size()}) > UINT16_MAX) {
+                throw length_error("远程调用字段超过65535字节");
+            }
+        }
+    }
+
+    //收发中途出错时连接上可能还留着没读的应答，之后的调用会读到错位的帧，所以直接关闭连接，之后的调用立即失败
+    template<typename Call>
+    void Exchange(Call call) {
+        if (this->fd < 0) {
+            throw runtime_error("远程调用连接已断开");
+        }
+        try {
+            call();
+        } catch (...) {
+            close(this->fd);
+            this->fd = -1;
+            throw;
+        }
+    }
+
+    void Send(const TicketQuery *queries, size_t count) {
+        iovec *iov = this->iov.data();
+        for (size_t i = 0; i < count; ++i) {
+            const TicketQuery &query = queries[i];
+            Header &header = this->headers[i];
+            uint32_t length = 4 + 6 + query.from.size() + query.to.size() + query.date.size();
+            uint32_t id = ++this->nextId;
+            uint16_t fromLength = query.from.size(), toLength = query.to.size(), dateLength = query.date.size();
+            memcpy(header.head, &length, 4);
+            memcpy(header.head + 4, &id, 4);
+            memcpy(header.head + 8, &fromLength, 2);
+            memcpy(header.toLength, &toLength, 2);
+            memcpy(header.dateLength, &dateLength, 2);
+            *iov++ = {header.head, sizeof(header.head)};
+            *iov++ = {(void *) query.from.data(), query.from.size()};
+            *iov++ = {header.toLength, 2};
+            *iov++ = {(void *) query.to.data(), query.to.size()};
+            *iov++ = {header.dateLength, 2};
+            *iov++ = {(void *) query.date.data(), query.date.size()};
+        }
+        if (!wire::WriteAll(this->fd, this->iov.data(), iov - this->iov.data())) {
+            throw runtime_error("远程调用发送失败");
+        }
+    }
+
+    void Receive(Ticket &ticket) {
+        string_view frame;
+        if (!this->reader.Next(this->fd, frame)) {
+            throw runtime_error("远程调用连接已关闭或应答帧过长");
+        }
+        const char *p = frame.data(), *end = p + frame.size();
+        uint32_t id = wire::Get<uint32_t>(p, end);
+        if (id != ++this->receivedId) {
+            throw runtime_error("远程调用应答乱序");
+        }
+        ticket.price = wire::Get<int32_t>(p, end);
+        ticket.serial = wire::Get<uint64_t>(p, end);
+        ticket.soldOut = wire::Get<uint8_t>(p, end);
+        ticket.route = wire::GetField<uint32_t>(p, end);
+    }
+
+    int fd = -1;
+    mutex lock;
+    uint32_t nextId = 0;
+    uint32_t receivedId = 0;
+    vector<Header> headers;
+    vector<iovec> iov;
+    wire::FrameReader reader;
+};
+
+#endif
+
 void test01() {
     AbstractSubject*pBase=new User;
     pBase->PurchaseTicket();
@@ -59,6 +1169,454 @@ void test01() {
     proxy->PurchaseTicket();
 }
 
-int main() {
+//threadCount个线程各做ops次查询，查询在routes条线路里随机选；routes越多命中率越低
+void BenchCache(size_t threadCount, size_t ops, size_t routes, size_t capacity) {
+    vector<TicketQuery> queries;
+    for (size_t i = 0; i < routes; ++i) {
+        queries.push_back({"北京", "城市" + to_string(i), "2024-10-01"});
+    }
+    auto run = [&](AbstractSubject &subject) {
+        auto begin = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (size_t t = 0; t < threadCount; ++t) {
+            threads.emplace_back([&, t] {
+                mt19937_64 rng(t);
+                for (size_t i = 0; i < ops; ++i) {
+                    subject.PurchaseTicket(queries[rng() % routes]);
+                }
+            });
+        }
+        for (auto &t: threads) {
+            t.join();
+        }
+        return threadCount * ops / chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    };
+
+    User direct(chrono::microseconds(50));
+    double directRate = run(direct);
+    User backend(chrono::microseconds(50));
+    Ctrip proxy(&backend, capacity);
+    double proxyRate = run(proxy);
+    cout << "线路:" << routes << " 缓存容量:" << capacity << " 命中率:"
+         << 100.0 * proxy.Hits() / (proxy.Hits() + proxy.Misses()) << "%"
+         << " 直连:" << (size_t) directRate << "次/秒 缓存代理:" << (size_t) proxyRate << "次/秒"
+         << " 后端调用:" << backend.Calls() << endl;
+}
+
+void test02() {
+    for (size_t routes: {100, 1000, 10000, 100000}) {
+        BenchCache(8, 5000, routes, 4096);
+    }
+}
+
+//并发能力有限的后端：最多同时处理slots个查询，其余的排队
+class ThrottledUser : public AbstractSubject {
+public:
+    ThrottledUser(chrono::microseconds latency) : backend(latency) {}
+
+    void PurchaseTicket() {
+        backend.PurchaseTicket();
+    }
+
+    Ticket PurchaseTicket(const TicketQuery &query) {
+        slots.acquire();
+        Ticket ticket = backend.PurchaseTicket(query);
+        slots.release();
+        return ticket;
+    }
+
+    vector<Ticket> PurchaseTickets(const vector<TicketQuery> &queries) {
+        slots.acquire();
+        vector<Ticket> tickets = backend.PurchaseTickets(queries);
+        slots.release();
+        return tickets;
+    }
+
+    size_t Calls() const { return backend.Calls(); }
+
+private:
+    User backend;
+    counting_semaphore<> slots{4};
+};
+
+//热门线路开售：threadCount个线程每轮同时发起查询，查询集中在hotRoutes条线路上
+void BenchStampede(bool coalesce, size_t threadCount, size_t rounds, size_t hotRoutes) {
+    ThrottledUser backend(chrono::milliseconds(1));
+    SingleFlightProxy proxy(&backend);
+    AbstractSubject &subject = coalesce ? (AbstractSubject &) proxy : (AbstractSubject &) backend;
+    vector<TicketQuery> queries;
+    for (size_t i = 0; i < hotRoutes; ++i) {
+        queries.push_back({"北京", "上海" + to_string(i), "2024-10-01"});
+    }
+    vector<vector<double>> latencies(threadCount);
+    barrier start(threadCount);
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t r = 0; r < rounds; ++r) {
+                start.arrive_and_wait();
+                auto begin = chrono::steady_clock::now();
+                subject.PurchaseTicket(queries[(t + r) % hotRoutes]);
+                latencies[t].push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    vector<double> all;
+    for (auto &v: latencies) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    sort(all.begin(), all.end());
+    cout << (coalesce ? "合并请求" : "直连后端") << " 线程:" << threadCount << " 请求:" << all.size()
+         << " 后端调用:" << backend.Calls() << " p50:" << all[all.size() / 2] << "ms p99:"
+         << all[all.size() * 99 / 100] << "ms" << endl;
+}
+
+void test03() {
+    BenchStampede(false, 64, 50, 2);
+    BenchStampede(true, 64, 50, 2);
+}
+
+//threadCount个线程各做ops次同步查询，batchSize为0时直连后端，否则经过批量代理
+void BenchBatching(size_t batchSize, chrono::microseconds delay, size_t threadCount, size_t ops) {
+    ThrottledUser backend(chrono::microseconds(200));
+    optional<BatchingProxy> proxy;
+    AbstractSubject *subject = &backend;
+    if (batchSize != 0) {
+        subject = &proxy.emplace(&backend, batchSize, delay);
+    }
+    vector<vector<double>> latencies(threadCount);
+    auto begin = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < ops; ++i) {
+                auto start = chrono::steady_clock::now();
+                subject->PurchaseTicket({"北京", "城市" + to_string(i % 100), "2024-10-01"});
+                latencies[t].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    vector<double> all;
+    for (auto &v: latencies) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    sort(all.begin(), all.end());
+    if (batchSize == 0) {
+        cout << "直连后端";
+    } else {
+        cout << "批量代理 N:" << batchSize << " T:" << delay.count() << "us 平均批大小:"
+             << (double) all.size() / proxy->Batches();
+    }
+    cout << " 吞吐:" << (size_t) (all.size() / seconds) << "次/秒 p50:" << all[all.size() / 2] << "us p99:"
+         << all[all.size() * 99 / 100] << "us" << endl;
+}
+
+void test04() {
+    BenchBatching(0, chrono::microseconds(0), 64, 100);
+    for (size_t batchSize: {1, 16, 64}) {
+        for (int delay: {100, 1000}) {
+            BenchBatching(batchSize, chrono::microseconds(delay), 64, 100);
+        }
+    }
+    //负载低时攒不满一批，增加的延迟取决于T
+    BenchBatching(0, chrono::microseconds(0), 4, 200);
+    for (int delay: {100, 1000}) {
+        BenchBatching(64, chrono::microseconds(delay), 4, 200);
+    }
+}
+
+//对照：一把锁保护的一个计数
+class MutexSeatCounter {
+public:
+    MutexSeatCounter(int64_t seats) : seats(seats) {}
+
+    bool TryAcquire() {
+        lock_guard<mutex> guard(lock);
+        if (seats == 0) {
+            return false;
+        }
+        --seats;
+        return true;
+    }
+
+private:
+    mutex lock;
+    int64_t seats;
+};
+
+//threadCount个线程一共买ops张票，座位足够多，统计每秒购票数
+template<typename Inventory>
+double BenchSeats(size_t threadCount, size_t ops) {
+    Inventory inventory(ops);
+    vector<thread> threads;
+    auto begin = chrono::steady_clock::now();
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&] {
+            for (size_t i = 0; i < ops / threadCount; ++i) {
+                inventory.TryAcquire();
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    return ops / chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+void test05() {
+    //64个线程抢1000个座位，卖出的票数必须正好是1000
+    TicketInventory inventory;
+    inventory.AddTrain("北京-上海 2024-10-01", 1000);
+    User backend(chrono::microseconds(0), &inventory);
+    atomic<size_t> sold{0}, soldOut{0};
+    vector<thread> threads;
+    for (size_t t = 0; t < 64; ++t) {
+        threads.emplace_back([&] {
+            for (size_t i = 0; i < 100; ++i) {
+                Ticket ticket = backend.PurchaseTicket({"北京", "上海", "2024-10-01"});
+                (ticket.soldOut ? soldOut : sold).fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    cout << "座位:1000 售出:" << sold << " 无票:" << soldOut << " 余票:"
+         << inventory.Find("北京-上海 2024-10-01")->Remaining() << endl;
+
+    for (size_t threadCount: {1, 2, 4, 8, 16, 32, 64}) {
+        cout << "线程:" << threadCount << " 分片原子计数:" << (size_t) BenchSeats<SeatInventory>(threadCount, 20000000)
+             << "次/秒 单锁计数:" << (size_t) BenchSeats<MutexSeatCounter>(threadCount, 20000000) << "次/秒" << endl;
+    }
+}
+
+//一个线程连续提交count个异步查询，统计同时在途的最大调用数和每秒完成数
+void BenchAsync(size_t workerCount, size_t queueCapacity, size_t count) {
+    User backend(chrono::milliseconds(1));
+    AsyncProxy proxy(&backend, workerCount, queueCapacity);
+    deque<future<Ticket>> inflight;
+    size_t completed = 0, maxInflight = 0;
+    auto begin = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        inflight.push_back(proxy.PurchaseTicketAsync({"北京", "城市" + to_string(i), "2024-10-01"}));
+        maxInflight = max(maxInflight, inflight.size());
+        while (!inflight.empty() && inflight.front().wait_for(chrono::seconds(0)) == future_status::ready) {
+            inflight.front().get();
+            inflight.pop_front();
+            ++completed;
+        }
+    }
+    for (auto &f: inflight) {
+        f.get();
+        ++completed;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << "异步代理 工作线程:" << workerCount << " 队列容量:" << queueCapacity << " 最大在途:" << maxInflight
+         << " 完成:" << (size_t) (completed / seconds) << "次/秒" << endl;
+}
+
+void test06() {
+    {
+        User backend(chrono::milliseconds(1));
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < 500; ++i) {
+            backend.PurchaseTicket({"北京", "上海", "2024-10-01"});
+        }
+        cout << "同步调用 完成:" << (size_t) (500 / chrono::duration<double>(chrono::steady_clock::now() - begin).count())
+             << "次/秒" << endl;
+    }
+    for (size_t workerCount: {8, 64, 256}) {
+        BenchAsync(workerCount, 4 * workerCount, 20000);
+    }
+
+    //取消一半查询，再给另一半很短的截止时间，队列后面的查询会超时
+    User backend(chrono::milliseconds(1));
+    AsyncProxy proxy(&backend, 4, 1000);
+    stop_source cancel;
+    vector<future<Ticket>> results;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(20);
+    for (size_t i = 0; i < 200; ++i) {
+        results.push_back(i % 2 == 0 ? proxy.PurchaseTicketAsync({"北京", "上海", "2024-10-01"}, deadline)
+                                     : proxy.PurchaseTicketAsync({"北京", "广州", "2024-10-01"},
+                                                                 chrono::steady_clock::time_point::max(),
+                                                                 cancel.get_token()));
+    }
+    cancel.request_stop();
+    size_t ok = 0, cancelled = 0, timedOut = 0;
+    for (auto &f: results) {
+        try {
+            f.get();
+            ++ok;
+        } catch (const TicketCancelled &) {
+            ++cancelled;
+        } catch (const TicketDeadlineExceeded &) {
+            ++timedOut;
+        }
+    }
+    cout << "提交:200 完成:" << ok << " 取消:" << cancelled << " 超时:" << timedOut << endl;
+}
+
+//构造代价大的真实主题：构造时要加载buildCost那么久的票价表、建立连接
+unique_ptr<AbstractSubject> MakeExpensiveUser(chrono::milliseconds buildCost) {
+    this_thread::sleep_for(buildCost);
+    return make_unique<User>();
+}
+
+//mode: 0立即构造 1懒构造 2后台预热；启动后先做otherWork那么久的其他初始化，再发起第一次购票
+void BenchLazy(int mode, chrono::milliseconds buildCost, chrono::milliseconds otherWork) {
+    auto begin = chrono::steady_clock::now();
+    unique_ptr<AbstractSubject> subject;
+    if (mode == 0) {
+        subject = MakeExpensiveUser(buildCost);
+    } else {
+        subject = make_unique<LazyProxy>([buildCost] { return MakeExpensiveUser(buildCost); }, mode == 2);
+    }
+    double startup = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    this_thread::sleep_for(otherWork);
+    auto first = chrono::steady_clock::now();
+    subject->PurchaseTicket({"北京", "上海", "2024-10-01"});
+    double firstCall = chrono::duration<double, milli>(chrono::steady_clock::now() - first).count();
+    const char *names[] = {"立即构造", "懒构造", "后台预热"};
+    cout << names[mode] << " 启动:" << startup << "ms 第一次购票:" << firstCall << "ms" << endl;
+}
+
+void test07() {
+    for (int mode: {0, 1, 2}) {
+        BenchLazy(mode, chrono::milliseconds(50), chrono::milliseconds(30));
+    }
+}
+
+//对比直接调用和经过计时代理调用，得到每次调用的额外开销
+void BenchTracing(size_t calls) {
+    User backend;
+    AbstractSubject *direct = &backend;
+    Traced<AbstractSubject> traced(&backend, "AbstractSubject");
+    TicketQuery query{"北京", "上海", "2024-10-01"};
+    auto measure = [&](auto &&call) {
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            call();
+        }
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / calls;
+    };
+    double directNs = measure([&] { direct->PurchaseTicket(query); });
+    TraceRegistry::Instance().SetRecordEvents(false);
+    double histogramNs = measure([&] { traced("PurchaseTicket")->PurchaseTicket(query); });
+    TraceRegistry::Instance().SetRecordEvents(true);
+    double eventNs = measure([&] { traced("PurchaseTicket")->PurchaseTicket(query); });
+    cout << "直接调用:" << directNs << "ns/次 计时代理(只记直方图):" << histogramNs << "ns/次(额外"
+         << histogramNs - directNs << "ns) 计时代理(记直方图和事件):" << eventNs << "ns/次(额外"
+         << eventNs - directNs << "ns)" << endl;
+}
+
+void test08() {
+    TraceRegistry::Instance().Clear();
+    User backend(chrono::microseconds(100));
+    Ctrip ctrip(&backend);
+    Traced<AbstractSubject> traced(&ctrip, "Ctrip");
+    vector<thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < 50; ++i) {
+                traced("PurchaseTicket")->PurchaseTicket({"北京", "城市" + to_string((t * 50 + i) % 60), "2024-10-01"});
+            }
+            traced("PurchaseTickets")->PurchaseTickets({{"北京", "上海", "2024-10-01"}, {"北京", "广州", "2024-10-01"}});
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    TraceRegistry::Instance().PrintSummary(cout);
+    string path = (filesystem::temp_directory_path() / "proxy_trace.json").string();
+    ofstream out(path);
+    TraceRegistry::Instance().WriteChromeTrace(out);
+    cout << "chrome trace已写入" << path << endl;
+
+    TraceRegistry::Instance().Clear();
+    BenchTracing(2000000);
+}
+
+#ifdef PROXY_HAS_UNIX_SOCKET
+
+//子进程运行User和服务端存根，父进程通过远程代理调用；先逐个同步调用，再流水线批量调用
+//后端的User没有余票库存，查询没有副作用，所以可以在远程代理前面再套一层携程缓存
+void BenchRemote(size_t calls, size_t batchSize) {
+    string path = "/tmp/proxy_" + to_string(getpid()) + ".sock";
+    User backend;
+    TicketServer server(&backend, path);
+    pid_t child = fork();
+    if (child < 0) {
+        cout << "fork失败，跳过远程代理测试" << endl;
+        return;
+    }
+    if (child == 0) {
+        server.Serve(2);
+        _exit(0);
+    }
+    auto report = [](const char *name, size_t calls, double seconds, vector<double> &latencies) {
+        sort(latencies.begin(), latencies.end());
+        cout << name << " 调用:" << calls << " 吞吐:" << (size_t) (calls / seconds) << "次/秒 p50:"
+             << latencies[latencies.size() / 2] << "us p99:" << latencies[latencies.size() * 99 / 100] << "us" << endl;
+    };
+    {
+        RemoteProxy remote(path);
+        Ctrip ctrip(&remote);
+        Ticket ticket = ctrip.PurchaseTicket({"北京", "上海", "2024-10-01"});
+        cout << "经携程缓存代理远程购票:" << ticket.route << " 票价:" << ticket.price << endl;
+
+        TicketQuery query{"北京", "上海", "2024-10-01"};
+        vector<double> latencies;
+        latencies.reserve(calls);
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            auto start = chrono::steady_clock::now();
+            remote.PurchaseTicket(query);
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+        }
+        report("逐个调用", calls, chrono::duration<double>(chrono::steady_clock::now() - begin).count(), latencies);
+    }
+    {
+        RemoteProxy remote(path);
+        vector<TicketQuery> batch(batchSize, {"北京", "上海", "2024-10-01"});
+        vector<double> latencies;
+        auto begin = chrono::steady_clock::now();
+        for (size_t done = 0; done < calls; done += batchSize) {
+            auto start = chrono::steady_clock::now();
+            remote.PurchaseTickets(batch);
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / batchSize);
+        }
+        report("流水线批量(每次平摊)", calls, chrono::duration<double>(chrono::steady_clock::now() - begin).count(),
+               latencies);
+    }
+    waitpid(child, nullptr, 0);
+}
+
+void test09() {
+    BenchRemote(200000, 1024);
+}
+
+#endif
+
+//默认只运行演示；带参数bench时运行全部基准测试，需要几十秒，test08会在临时目录写trace文件，test09会fork子进程并在/tmp下建套接字
+int main(int argc, char *argv[]) {
     test01();
+    if (argc > 1 && string(argv[1]) == "bench") {
+        test02();
+        test03();
+        test04();
+        test05();
+        test06();
+        test07();
+        test08();
+#ifdef PROXY_HAS_UNIX_SOCKET
+        test09();
+#endif
+    }
 }
\ No newline at end of file
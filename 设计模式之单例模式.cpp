@@ -34,18 +34,31 @@
  * 如果实例化的对象长时间未被使用，系统会认为该对象是垃圾而被回收，这可能会导致对象状态的丢失，不过这是JAVA的垃圾回收机制不管C++什么事
  */
 #include "iostream"
+#include "atomic"
+#include "mutex"
+#include "thread"
+#include "vector"
+#include "chrono"
 
 using namespace std;
 
+//懒汉式，双重检查：创建之后每次访问只是一次acquire读，不加锁也没有完整的内存栅栏；x86上就是一条普通的mov，ARMv8上是一条LDAR
+//第一次访问时加锁再检查一次，保证多个线程同时第一次访问时只创建一个对象；release写保证别的线程读到指针时对象已经构造完
 class SingleTon {
 public:
-    static SingleTon *m_singleTon;  //静态指针
+    static atomic<SingleTon *> m_singleTon;  //静态指针
 
     static SingleTon *GetInstance() {   //提供静态方法
-        if (m_singleTon == nullptr) {
-            m_singleTon = new SingleTon;
-            return m_singleTon;
+        SingleTon *instance = m_singleTon.load(memory_order_acquire);
+        if (instance == nullptr) {
+            lock_guard<mutex> guard(m_lock);
+            instance = m_singleTon.load(memory_order_relaxed);
+            if (instance == nullptr) {
+                instance = new SingleTon;
+                m_singleTon.store(instance, memory_order_release);
+            }
         }
+        return instance;
     }
 
     //  static SingleTon *GetInstance() {   //如果是饿汉模式就直接返回
@@ -59,12 +72,14 @@ public:
 private:
     SingleTon() {   //构造函数私有化
         cout << "构造对象" << endl;
-        m_singleTon = nullptr;
     }
+
+    static mutex m_lock;    //只在第一次创建时使用
 };
 
-//SingleTon*singleTon::m_singleTon=nullptr  //不在类外new，懒汉模式
-SingleTon *SingleTon::m_singleTon = new SingleTon;  //饿汉模式
+atomic<SingleTon *> SingleTon::m_singleTon{nullptr};  //不在类外new，懒汉模式
+//SingleTon *SingleTon::m_singleTon = new SingleTon;  //饿汉模式
+mutex SingleTon::m_lock;
 
 
 void test01() {
@@ -77,6 +92,80 @@ void test01() {
 }
 
 
+//对照：每次访问都加锁
+class MutexSingleTon {
+public:
+    static MutexSingleTon *GetInstance() {
+        lock_guard<mutex> guard(m_lock);
+        if (m_singleTon == nullptr) {
+            m_singleTon = new MutexSingleTon;
+        }
+        return m_singleTon;
+    }
+
+private:
+    MutexSingleTon() = default;
+
+    static MutexSingleTon *m_singleTon;
+    static mutex m_lock;
+};
+
+MutexSingleTon *MutexSingleTon::m_singleTon = nullptr;
+mutex MutexSingleTon::m_lock;
+
+//对照：每次访问都经过call_once
+class CallOnceSingleTon {
+public:
+    static CallOnceSingleTon *GetInstance() {
+        call_once(m_once, [] { m_singleTon = new CallOnceSingleTon; });
+        return m_singleTon;
+    }
+
+private:
+    CallOnceSingleTon() = default;
+
+    static CallOnceSingleTon *m_singleTon;
+    static once_flag m_once;
+};
+
+CallOnceSingleTon *CallOnceSingleTon::m_singleTon = nullptr;
+once_flag CallOnceSingleTon::m_once;
+
+//threadCount个线程各调用calls次GetInstance，返回每次调用的平均耗时(ns)
+template<typename Get>
+double BenchGetInstance(size_t threadCount, size_t calls, Get get) {
+    vector<thread> threads;
+    atomic<uintptr_t> sink{0};
+    auto begin = chrono::steady_clock::now();
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&] {
+            uintptr_t local = 0;
+            for (size_t i = 0; i < calls; ++i) {
+                local += reinterpret_cast<uintptr_t>(get());
+                atomic_signal_fence(memory_order_seq_cst);  //只是编译器屏障，不让编译器把循环里的调用合并掉
+            }
+            sink += local;
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / (threadCount * calls);
+}
+
+void test02() {
+    for (size_t threadCount: {1, 2, 4, 8, 16, 32, 64}) {
+        size_t calls = 20000000 / threadCount;
+        cout << dec << "线程:" << threadCount
+             << " 双重检查:" << BenchGetInstance(threadCount, calls, [] { return SingleTon::GetInstance(); }) << "ns/次"
+             << " 每次加锁:" << BenchGetInstance(threadCount, calls, [] { return MutexSingleTon::GetInstance(); })
+             << "ns/次 call_once:"
+             << BenchGetInstance(threadCount, calls, [] { return CallOnceSingleTon::GetInstance(); }) << "ns/次"
+             << endl;
+    }
+}
+
 int main() {
     test01();
+    test02();
 }
\ No newline at end of file